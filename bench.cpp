@@ -0,0 +1,434 @@
+#include "huffman.h"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <sys/resource.h>
+
+//encode/decode throughput, ratio and memory of the block codec on a synthetic corpus
+//and on any files given on the command line
+// ./bench   (synthetic corpus, 16 MiB per input)
+// ./bench -m 64 -r 5 file1 file2   (64 MiB inputs, best of 5 runs, plus two files)
+// ./bench -i 4 -l 12 -j 8 -o results.json   (coding options as for ./Huffman, JSON into a file)
+// ./bench -k avx2   (kernels to use, checked bit for bit against the portable scalar code)
+// ./bench -t   (block checksums with the portable tables instead of the SSE4.2 crc32 instruction)
+// ./bench -a rebuild   (version 4 adaptive streams as with ./Huffman -A, in frames of 1 MiB)
+struct BenchOptions{
+  int state = 0;
+  size_t inputSize = 16 << 20; // -m 16 (MiB of every synthetic input)
+  unsigned int runs = 3; // -r 3, the best run counts
+  std::string jsonName; // -o results.json, "-" prints the JSON instead of the table
+  BlockArchive::Settings settings; // -b -l -i -p as for ./Huffman, -c as its -o
+  bool sharedTable = false; // -s
+  unsigned int threads = 1; // -j
+  Kernels::Level kernels = Kernels::active(); // -k scalar|bmi2|avx2, as far as the CPU supports it
+  bool crcTables = false; // -t
+  bool adaptive = false; // -a fgk|rebuild, adaptive streams instead of block archives
+  unsigned int adaptiveModel = Adaptive::MODEL_FGK;
+  std::vector<std::string> fileNames;
+  void parseArgs(int argc, char** argv){
+    for(int i=1; i<argc; i++){
+      char* currentWord = argv[i];
+      if(this->state == 0){
+        if(currentWord[0] == '-' && currentWord[1] != '\0' && currentWord[2] == '\0'){
+          char flag = currentWord[1];
+          if(flag == 's'){
+            this->sharedTable = true;
+          }else if(flag == 't'){
+            this->crcTables = true;
+          }else if(strchr("mrobiljcpka", flag) != NULL){
+            this->state = flag;
+          }else{
+            BenchOptions::printHelpAndExit(argv);
+          }
+        }else{
+          this->fileNames.push_back(currentWord);
+        }
+        continue;
+      }
+      long value = atol(currentWord);
+      if(this->state == 'k'){
+        if(!Kernels::parse(currentWord, this->kernels)) BenchOptions::printHelpAndExit(argv);
+      }else if(this->state == 'a'){
+        this->adaptive = true;
+        this->adaptiveModel = (strcmp(currentWord, "rebuild") == 0 ? Adaptive::MODEL_REBUILD : Adaptive::MODEL_FGK);
+      }else if(this->state == 'p'){
+        this->settings.transform = (strcmp(currentWord, "bwt") == 0 ? BlockArchive::TRANSFORM_BWT : BlockArchive::TRANSFORM_NONE);
+      }else if(this->state == 'm'){
+        this->inputSize = size_t(std::max(1L, value)) << 20;
+      }else if(this->state == 'r'){
+        this->runs = std::max(1L, value);
+      }else if(this->state == 'o'){
+        this->jsonName = currentWord;
+      }else if(this->state == 'b'){
+        this->settings.blockSize = std::max(1L, value) * 1024;
+      }else if(this->state == 'i'){
+        this->settings.streams = std::min<long>(std::max(1L, value), BlockArchive::MAX_STREAMS);
+      }else if(this->state == 'l'){
+        this->settings.maxCodeLength = std::min<long>(std::max(0L, value), Huffman::MAX_CODE_LENGTH);
+      }else if(this->state == 'c'){
+        this->settings.contextTables = std::min<long>(std::max(0L, value), ContextModel::MAX_TABLES);
+      }else if(this->state == 'j'){
+        this->threads = std::max(0L, value);
+      }
+      this->state = 0;
+    }
+  }
+  static void printHelpAndExit(char** argv){
+    std::cout << "Usage: " << argv[0] << " [-m inputMiB] [-r runs] [-o results.json] [-b blockSizeKiB] [-l maxCodeLength] [-i streams] [-c contextTables] [-p none|bwt] [-k scalar|bmi2|avx2] [-a fgk|rebuild] [-s] [-t] [-j threads] [file...]" << std::endl;
+    exit(0);
+  }
+};
+
+struct BenchResult{
+  std::string name;
+  uint64_t rawSize = 0;
+  uint64_t archiveSize = 0;
+  uint64_t headerBytes = 0; //everything in the archive but coded data
+  double encodeSeconds = 0;
+  double decodeSeconds = 0;
+  uint64_t peakMemory = 0; //bytes of resident memory
+  bool ok = false;
+};
+
+//deterministic inputs with known statistics
+class Corpus{
+  private:
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint64_t next(){
+      //xorshift64*
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return state * 0x2545F4914F6CDD1DULL;
+    }
+    double uniform(){
+      return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+    //draws from weights through their cumulative sums
+    void sample(const std::vector<double>& weights, std::string& out, size_t size){
+      std::vector<double> cumulative(weights.size());
+      double sum = 0;
+      for(size_t i=0; i<weights.size(); i++) cumulative[i] = (sum += weights[i]);
+      out.resize(size);
+      for(size_t i=0; i<size; i++){
+        double u = uniform() * sum;
+        out[i] = (char)(std::lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin());
+      }
+    }
+  public:
+    //uniform random bytes, incompressible
+    std::string random(size_t size){
+      std::string out(size, '\0');
+      for(size_t i=0; i<size; i+=8){
+        uint64_t r = next();
+        memcpy(&out[i], &r, std::min<size_t>(8, size - i));
+      }
+      return out;
+    }
+    //Zipf distributed bytes (exponent 1.1), a few very frequent values and a long tail
+    std::string zipf(size_t size){
+      std::vector<double> weights(256);
+      for(int c=0; c<256; c++) weights[c] = 1.0 / std::pow(c + 1, 1.1);
+      std::string out;
+      sample(weights, out, size);
+      return out;
+    }
+    //words drawn with Zipf frequencies, separated by spaces, punctuation and line breaks
+    std::string text(size_t size){
+      static const char* words[] = {"the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+        "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they", "you", "were",
+        "their", "one", "all", "we", "can", "her", "has", "there", "been", "if", "more", "when", "will", "would", "who", "so",
+        "no", "Huffman", "code", "symbol", "frequency", "compression", "stream", "block", "table", "decoder", "encoder", "bit"};
+      const size_t wordCount = sizeof(words) / sizeof(words[0]);
+      std::vector<double> weights(wordCount);
+      for(size_t w=0; w<wordCount; w++) weights[w] = 1.0 / (w + 1);
+      std::string picks;
+      sample(weights, picks, size / 4 + 1);
+      std::string out;
+      out.reserve(size + 16);
+      for(size_t i=0; out.length() < size; i++){
+        out += words[(unsigned char)picks[i % picks.length()]];
+        uint64_t r = next() % 20;
+        out += (r == 0 ? ".\n" : r == 1 ? ", " : " ");
+      }
+      out.resize(size);
+      return out;
+    }
+    //a single byte value
+    std::string same(size_t size){
+      return std::string(size, 'a');
+    }
+    //every byte value present, with geometrically falling frequencies so the codes get long
+    std::string all256(size_t size){
+      std::vector<double> weights(256);
+      for(int c=0; c<256; c++) weights[c] = std::pow(0.95, c);
+      std::string out;
+      sample(weights, out, size);
+      for(int c=0; c<256 && size_t(c) < size; c++) out[(size_t(c) * 7919) % size] = (char)c;
+      return out;
+    }
+};
+
+class Bench{
+  private:
+    //peak resident memory since the last resetPeakMemory, in bytes
+    static uint64_t peakMemory(){
+      std::ifstream status("/proc/self/status");
+      std::string line;
+      while(std::getline(status, line)){
+        if(line.compare(0, 6, "VmHWM:") == 0) return strtoull(line.c_str() + 6, NULL, 10) * 1024;
+      }
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return uint64_t(usage.ru_maxrss) * 1024;
+    }
+    //restarts the peak from the current resident memory (Linux 4.0+, otherwise it keeps growing)
+    static void resetPeakMemory(){
+      std::ofstream clearRefs("/proc/self/clear_refs");
+      clearRefs << "5" << std::endl;
+    }
+    static double seconds(std::chrono::steady_clock::time_point start){
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    //archive bytes that are not coded data: headers, code tables and references to them,
+    //stream sizes, transform headers, checksums, index and footer, stored blocks count as data
+    static uint64_t headerBytes(const unsigned char* archive, size_t length, unsigned int streams){
+      BlockArchive::Info info;
+      if(!BlockArchive::readInfo(archive, length, info)) return 0;
+      uint64_t bytes = info.headerLength + BlockArchive::indexSize(info.blocks.size());
+      for(const BlockArchive::Block& b : info.blocks){
+        const unsigned char* block = archive + b.offset;
+        bytes += info.blockLength(b) - b.payloadSize;
+        if(block[0] == BlockArchive::BLOCK_STORED) continue;
+        if(info.transform() != BlockArchive::TRANSFORM_NONE) bytes += BlockArchive::TRANSFORM_HEADER_SIZE;
+        if(block[0] == BlockArchive::BLOCK_CONTEXT){
+          unsigned char contextMap[256];
+          std::vector<DecodeTable> tables;
+          bytes += ContextModel::read(block + BlockArchive::BLOCK_HEADER_SIZE, b.payloadSize, contextMap, tables);
+          continue;
+        }
+        bytes += (streams - 1)*BlockArchive::STREAM_SIZE_BYTES;
+        if(block[0] == BlockArchive::BLOCK_OWN_TABLE){
+          unsigned char codeLengths[256];
+          bytes += BlockArchive::blockTable(block, BlockArchive::BLOCK_HEADER_SIZE + b.payloadSize, codeLengths);
+        }else if(block[0] == BlockArchive::BLOCK_REUSED_TABLE){
+          bytes += BlockArchive::TABLE_REFERENCE_SIZE;
+        }
+      }
+      return bytes;
+    }
+    //codes input into a version 4 stream, one frame per MAX_FRAME_SIZE bytes
+    static void encodeAdaptive(const std::string& input, AdaptiveEncoder& encoder, unsigned char* frame, size_t frameBound, std::vector<unsigned char>& archive){
+      archive.resize(Adaptive::HEADER_SIZE);
+      encoder.header(archive.data());
+      for(size_t pos=0; pos<input.length(); pos+=Adaptive::MAX_FRAME_SIZE){
+        size_t size = std::min<size_t>(Adaptive::MAX_FRAME_SIZE, input.length() - pos);
+        size_t length = encoder.encodeFrame(Span<const unsigned char>((const unsigned char*)input.data() + pos, size), Span<unsigned char>(frame, frameBound));
+        archive.insert(archive.end(), frame, frame + length);
+      }
+      size_t length = encoder.end(frame);
+      archive.insert(archive.end(), frame, frame + length);
+    }
+    //decodes a version 4 stream into decoded, false if it is corrupted or does not fit
+    static bool decodeAdaptive(const std::vector<unsigned char>& archive, AdaptiveDecoder& decoder, std::vector<unsigned char>& decoded, size_t& decodedSize){
+      decodedSize = 0;
+      if(!decoder.open(archive.data(), archive.size())) return false;
+      size_t pos = Adaptive::HEADER_SIZE;
+      while(true){
+        uint32_t rawSize, payloadSize;
+        if(pos + Adaptive::FRAME_HEADER_SIZE > archive.size() || !decoder.frameSizes(archive.data() + pos, rawSize, payloadSize)) return false;
+        pos += Adaptive::FRAME_HEADER_SIZE;
+        if(rawSize == 0) return true;
+        if(pos + payloadSize > archive.size() || decodedSize + rawSize > decoded.size()) return false;
+        if(!decoder.decodeFrame(Span<const unsigned char>(archive.data() + pos, payloadSize), Span<unsigned char>(decoded.data() + decodedSize, rawSize))) return false;
+        pos += payloadSize;
+        decodedSize += rawSize;
+      }
+    }
+    //as run() for adaptive streams, frame headers count as header bytes
+    static BenchResult runAdaptive(const std::string& name, const std::string& input, const BenchOptions& options){
+      BenchResult result;
+      result.name = name;
+      result.rawSize = input.length();
+      resetPeakMemory();
+      AdaptiveEncoder encoder(options.adaptiveModel);
+      AdaptiveDecoder decoder;
+      size_t frameBound = encoder.frameBound(Adaptive::MAX_FRAME_SIZE);
+      std::unique_ptr<unsigned char[]> frame(new unsigned char[frameBound]);
+      std::vector<unsigned char> archive;
+      std::vector<unsigned char> decoded(input.length());
+      result.ok = true;
+      for(unsigned int r=0; r<options.runs; r++){
+        auto start = std::chrono::steady_clock::now();
+        encodeAdaptive(input, encoder, frame.get(), frameBound, archive);
+        double encodeSeconds = seconds(start);
+        start = std::chrono::steady_clock::now();
+        size_t decodedSize;
+        bool ok = decodeAdaptive(archive, decoder, decoded, decodedSize);
+        double decodeSeconds = seconds(start);
+        result.ok = result.ok && ok && decodedSize == input.length() && memcmp(decoded.data(), input.data(), input.length()) == 0;
+        if(r == 0 || encodeSeconds < result.encodeSeconds) result.encodeSeconds = encodeSeconds;
+        if(r == 0 || decodeSeconds < result.decodeSeconds) result.decodeSeconds = decodeSeconds;
+      }
+      size_t frames = (input.length() + Adaptive::MAX_FRAME_SIZE - 1) / Adaptive::MAX_FRAME_SIZE;
+      result.archiveSize = archive.size();
+      result.headerBytes = Adaptive::HEADER_SIZE + (frames + 1)*Adaptive::FRAME_HEADER_SIZE;
+      result.peakMemory = peakMemory();
+      if(options.kernels > Kernels::SCALAR){
+        Kernels::select(Kernels::SCALAR);
+        std::vector<unsigned char> reference;
+        encodeAdaptive(input, encoder, frame.get(), frameBound, reference);
+        result.ok = result.ok && reference == archive;
+        Kernels::select(options.kernels);
+      }
+      return result;
+    }
+  public:
+    static BenchResult run(const std::string& name, const std::string& input, const BenchOptions& options, ThreadPool& pool){
+      if(options.adaptive) return runAdaptive(name, input, options);
+      BenchResult result;
+      result.name = name;
+      result.rawSize = input.length();
+      resetPeakMemory();
+      BlockArchive::Settings settings = options.settings;
+      unsigned char sharedLengths[256];
+      //a shared table is counted on untransformed bytes, so transformed blocks get their own
+      if(options.sharedTable && settings.transform == BlockArchive::TRANSFORM_NONE){
+        uint64_t frequencies[256] = {0};
+        Histogram::count((const unsigned char*)input.data(), input.length(), frequencies, pool);
+        Huffman::buildCodeLengths(frequencies, settings.maxCodeLength, sharedLengths);
+        settings.sharedLengths = sharedLengths;
+      }
+      Encoder encoder(settings, &pool);
+      Decoder decoder(&pool);
+      std::vector<unsigned char> archive(encoder.bound(input.length()));
+      std::vector<unsigned char> decoded(input.length());
+      Span<const unsigned char> in((const unsigned char*)input.data(), input.length());
+      result.ok = true;
+      for(unsigned int r=0; r<options.runs; r++){
+        auto start = std::chrono::steady_clock::now();
+        result.archiveSize = encoder.encode(in, Span<unsigned char>(archive.data(), archive.size()));
+        double encodeSeconds = seconds(start);
+        start = std::chrono::steady_clock::now();
+        bool ok = decoder.open(Span<const unsigned char>(archive.data(), result.archiveSize))
+          && decoder.decode(Span<unsigned char>(decoded.data(), decoded.size()));
+        double decodeSeconds = seconds(start);
+        result.ok = result.ok && ok && memcmp(decoded.data(), input.data(), input.length()) == 0;
+        if(r == 0 || encodeSeconds < result.encodeSeconds) result.encodeSeconds = encodeSeconds;
+        if(r == 0 || decodeSeconds < result.decodeSeconds) result.decodeSeconds = decodeSeconds;
+      }
+      result.headerBytes = headerBytes(archive.data(), result.archiveSize, settings.streams);
+      result.peakMemory = peakMemory();
+      //the kernels have to match the scalar code bit for bit: the same archive, decoded the same
+      if(options.kernels > Kernels::SCALAR){
+        Kernels::select(Kernels::SCALAR);
+        std::vector<unsigned char> reference(archive.size());
+        size_t referenceSize = encoder.encode(in, Span<unsigned char>(reference.data(), reference.size()));
+        bool same = referenceSize == result.archiveSize && memcmp(reference.data(), archive.data(), referenceSize) == 0;
+        memset(decoded.data(), 0, decoded.size());
+        same = same && decoder.open(Span<const unsigned char>(archive.data(), result.archiveSize))
+          && decoder.decode(Span<unsigned char>(decoded.data(), decoded.size()))
+          && memcmp(decoded.data(), input.data(), input.length()) == 0;
+        Kernels::select(options.kernels);
+        result.ok = result.ok && same;
+      }
+      return result;
+    }
+
+    static double throughput(uint64_t bytes, double seconds){
+      return seconds > 0 ? bytes / seconds / 1e6 : 0;
+    }
+    static double ratio(const BenchResult& r){
+      return r.rawSize ? double(r.archiveSize) / r.rawSize : 0;
+    }
+
+    static void printTable(const std::vector<BenchResult>& results, std::ostream& out){
+      out << std::left << std::setw(24) << "input" << std::right << std::setw(12) << "raw bytes" << std::setw(12) << "archive"
+          << std::setw(8) << "ratio" << std::setw(10) << "header" << std::setw(12) << "enc MB/s" << std::setw(12) << "dec MB/s"
+          << std::setw(12) << "peak MiB" << "  ok" << std::endl;
+      for(const BenchResult& r : results){
+        out << std::left << std::setw(24) << r.name.substr(0, 23) << std::right << std::setw(12) << r.rawSize << std::setw(12) << r.archiveSize
+            << std::fixed << std::setprecision(3) << std::setw(8) << ratio(r) << std::setw(10) << r.headerBytes
+            << std::setprecision(1) << std::setw(12) << throughput(r.rawSize, r.encodeSeconds) << std::setw(12) << throughput(r.rawSize, r.decodeSeconds)
+            << std::setw(12) << r.peakMemory / 1048576.0 << (r.ok ? "  yes" : "  NO") << std::endl;
+      }
+    }
+
+    static std::string jsonString(const std::string& s){
+      std::string ret = "\"";
+      for(char c : s){
+        if(c == '"' || c == '\\'){
+          ret += '\\';
+          ret += c;
+        }else if((unsigned char)c < 0x20){
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          ret += escaped;
+        }else{
+          ret += c;
+        }
+      }
+      return ret + "\"";
+    }
+
+    static void printJson(const std::vector<BenchResult>& results, const BenchOptions& options, std::ostream& out){
+      const BlockArchive::Settings& s = options.settings;
+      out << "{\n  \"settings\": {\"blockSize\": " << s.blockSize << ", \"maxCodeLength\": " << s.maxCodeLength
+          << ", \"streams\": " << s.streams << ", \"contextTables\": " << s.contextTables
+          << ", \"transform\": \"" << (s.transform == BlockArchive::TRANSFORM_BWT ? "bwt" : "none") << "\", \"sharedTable\": " << (options.sharedTable ? "true" : "false")
+          << ", \"adaptive\": \"" << (!options.adaptive ? "none" : options.adaptiveModel == Adaptive::MODEL_REBUILD ? "rebuild" : "fgk")
+          << "\", \"kernels\": \"" << Kernels::name(Kernels::active()) << "\", \"crc\": \"" << (Crc32c::active() ? "sse4.2" : "tables")
+          << "\", \"threads\": " << options.threads << ", \"runs\": " << options.runs << "},\n  \"results\": [\n";
+      for(size_t i=0; i<results.size(); i++){
+        const BenchResult& r = results[i];
+        out << "    {\"input\": " << jsonString(r.name) << ", \"rawBytes\": " << r.rawSize << ", \"archiveBytes\": " << r.archiveSize
+            << ", \"ratio\": " << std::setprecision(6) << ratio(r) << ", \"headerBytes\": " << r.headerBytes
+            << ", \"encodeMBps\": " << throughput(r.rawSize, r.encodeSeconds) << ", \"decodeMBps\": " << throughput(r.rawSize, r.decodeSeconds)
+            << ", \"peakMemoryBytes\": " << r.peakMemory << ", \"ok\": " << (r.ok ? "true" : "false") << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+      }
+      out << "  ]\n}" << std::endl;
+    }
+};
+
+int main(int argc, char** argv){
+  BenchOptions options;
+  options.parseArgs(argc, argv);
+  Kernels::select(options.kernels);
+  Crc32c::select(!options.crcTables);
+  ThreadPool pool(options.threads);
+  std::vector<BenchResult> results;
+  {
+    Corpus corpus;
+    size_t size = options.inputSize;
+    results.push_back(Bench::run("random", corpus.random(size), options, pool));
+    results.push_back(Bench::run("zipf", corpus.zipf(size), options, pool));
+    results.push_back(Bench::run("text", corpus.text(size), options, pool));
+    results.push_back(Bench::run("same", corpus.same(size), options, pool));
+    results.push_back(Bench::run("all256", corpus.all256(size), options, pool));
+  }
+  for(const std::string& fileName : options.fileNames){
+    std::ifstream fs(fileName, std::ios_base::in | std::ios_base::binary);
+    if(!fs.is_open()){
+      std::cerr << "Error in read: " << fileName << ": " << strerror(errno) << std::endl;
+      continue;
+    }
+    std::stringstream content;
+    content << fs.rdbuf();
+    results.push_back(Bench::run(fileName, content.str(), options, pool));
+  }
+  if(options.jsonName == "-"){
+    Bench::printJson(results, options, std::cout);
+  }else{
+    Bench::printTable(results, std::cout);
+    if(options.jsonName.length() != 0){
+      std::ofstream json(options.jsonName, std::ios::trunc | std::ios::out);
+      Bench::printJson(results, options, json);
+    }
+  }
+  for(const BenchResult& r : results){
+    if(!r.ok) return 1;
+  }
+  return 0;
+}
@@ -1,48 +1,634 @@
+#include "huffman.h"
 #include <fstream>
-#include <string>
-#include <cstring>
-#include <cstdint>
 #include <string.h>
-#include <map>
-#include <unordered_map>
-#include <iostream>
-#include <iomanip>
-#include <utility>
-#include <vector>
-#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <deque>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef IORING_FEAT_RW_CUR_POS
+#define HUFFMAN_IO_URING 1 //reads and writes queued to the kernel, see AsyncIO
+#endif
+#endif
+#endif
 
 using namespace std;
 
-void binDump(unsigned char i){
-  for(int j = 0; j < 8; j++) std::cout << (i & (0x01 << (7-j) ) ? "1" : "0");
-  std::cout << std::endl;
-}
+//reads and writes that complete in the background while the caller codes: with io_uring the
+//kernel runs them from rings shared with the process, set up with raw syscalls; where the kernel
+//or a sandbox refuses it a worker thread issues them one after another, SYNC does them at once
+//like any request to read or write, one may move fewer bytes than asked, completions carry a tag
+class AsyncIO{
+  public:
+    enum Backend{SYNC, THREADS, URING};
+  private:
+    struct Request{
+      bool write;
+      int fd;
+      unsigned char* buffer;
+      size_t length;
+      int64_t offset; //-1 for the current file position, the only one pipes have
+      uint64_t tag;
+      int64_t result; //bytes moved or -errno
+    };
+    Backend used = SYNC;
+    unsigned int inFlight = 0;
+    //SYNC and THREADS: requests for the worker and what it has done, both in order
+    std::deque<Request> queued;
+    std::deque<Request> done;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable completed;
+    bool stopping = false;
+    std::thread worker;
+#ifdef HUFFMAN_IO_URING
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    void* sqeArray = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqeArraySize = 0;
+    unsigned* sqTail = NULL;
+    unsigned* sqMask = NULL;
+    unsigned* sqIndices = NULL;
+    unsigned* cqHead = NULL;
+    unsigned* cqTail = NULL;
+    unsigned* cqMask = NULL;
+    io_uring_sqe* sqes = NULL;
+    io_uring_cqe* cqes = NULL;
+    //false if io_uring is missing or too old to read and write at the current position (5.6)
+    bool setupRing(unsigned int entries){
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+      if(ringFd < 0) return false;
+      if(!(params.features & IORING_FEAT_RW_CUR_POS)){
+        this->closeRing();
+        return false;
+      }
+      sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+      cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+      bool single = (params.features & IORING_FEAT_SINGLE_MMAP);
+      if(single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+      sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+      cqRing = single ? sqRing : mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+      sqeArraySize = params.sq_entries*sizeof(io_uring_sqe);
+      sqeArray = mmap(NULL, sqeArraySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+      if(sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeArray == MAP_FAILED){
+        this->closeRing();
+        return false;
+      }
+      unsigned char* sq = (unsigned char*) sqRing;
+      sqTail = (unsigned*)(sq + params.sq_off.tail);
+      sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+      sqIndices = (unsigned*)(sq + params.sq_off.array);
+      unsigned char* cq = (unsigned char*) cqRing;
+      cqHead = (unsigned*)(cq + params.cq_off.head);
+      cqTail = (unsigned*)(cq + params.cq_off.tail);
+      cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+      cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+      sqes = (io_uring_sqe*) sqeArray;
+      return true;
+    }
+    void closeRing(){
+      if(sqeArray != MAP_FAILED) munmap(sqeArray, sqeArraySize);
+      if(cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+      if(sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+      if(ringFd >= 0) ::close(ringFd);
+      sqeArray = cqRing = sqRing = MAP_FAILED;
+      ringFd = -1;
+    }
+#endif
+    static std::atomic<int>& choice(){
+      static std::atomic<int> backend{URING};
+      return backend;
+    }
+    //a write at the current position goes out whole, the next one queued may not get ahead of its rest
+    static int64_t perform(const Request& r){
+      size_t total = 0;
+      while(true){
+        ssize_t moved;
+        if(r.write){
+          moved = r.offset < 0 ? ::write(r.fd, r.buffer + total, r.length - total) : ::pwrite(r.fd, r.buffer, r.length, r.offset);
+        }else{
+          moved = r.offset < 0 ? ::read(r.fd, r.buffer, r.length) : ::pread(r.fd, r.buffer, r.length, r.offset);
+        }
+        if(moved < 0 && errno == EINTR) continue;
+        if(moved < 0) return total > 0 ? int64_t(total) : -errno;
+        total += moved;
+        if(!r.write || r.offset >= 0 || moved == 0 || total == r.length) return total;
+      }
+    }
+    void work(){
+      std::unique_lock<std::mutex> lock(mutex);
+      while(true){
+        wake.wait(lock, [this]{ return stopping || !queued.empty(); });
+        if(queued.empty()) return;
+        Request r = queued.front();
+        queued.pop_front();
+        lock.unlock();
+        r.result = AsyncIO::perform(r);
+        lock.lock();
+        done.push_back(r);
+        completed.notify_one();
+      }
+    }
+  public:
+    //entries bounds the requests in flight at once, the backend falls back to THREADS without io_uring
+    AsyncIO(Backend backend, unsigned int entries){
+#ifdef HUFFMAN_IO_URING
+      if(backend == URING && this->setupRing(entries)){
+        used = URING;
+        return;
+      }
+#endif
+      used = (backend == SYNC ? SYNC : THREADS);
+      if(used == THREADS) worker = std::thread(&AsyncIO::work, this);
+    }
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+    //waits for the requests in flight, their buffers may not go away before
+    ~AsyncIO(){
+      this->drain();
+      if(worker.joinable()){
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+      }
+#ifdef HUFFMAN_IO_URING
+      this->closeRing();
+#endif
+    }
+    Backend backend() const {
+      return used;
+    }
+    unsigned int pending() const {
+      return inFlight;
+    }
+    //queues a read into or a write from buffer, false if the request could not be queued
+    bool submit(bool write, int fd, unsigned char* buffer, size_t length, int64_t offset, uint64_t tag){
+      Request r = {write, fd, buffer, length, offset, tag, 0};
+      if(used == SYNC){
+        r.result = AsyncIO::perform(r);
+        done.push_back(r);
+        inFlight++;
+        return true;
+      }
+      if(used == THREADS){
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          queued.push_back(r);
+        }
+        inFlight++;
+        wake.notify_one();
+        return true;
+      }
+#ifdef HUFFMAN_IO_URING
+      unsigned tail = *sqTail;
+      unsigned index = tail & *sqMask;
+      io_uring_sqe* sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t)(uintptr_t) buffer;
+      sqe->len = length;
+      sqe->off = (uint64_t) offset;
+      sqe->user_data = tag;
+      sqIndices[index] = index;
+      __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+      while(syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0) < 0){
+        if(errno != EINTR) return false;
+      }
+      inFlight++;
+      return true;
+#else
+      return false;
+#endif
+    }
+    //blocks until the next request completes, false if none is in flight
+    bool wait(uint64_t& tag, int64_t& result){
+      if(inFlight == 0) return false;
+      if(used != URING){
+        std::unique_lock<std::mutex> lock(mutex);
+        completed.wait(lock, [this]{ return !done.empty(); });
+        tag = done.front().tag;
+        result = done.front().result;
+        done.pop_front();
+        inFlight--;
+        return true;
+      }
+#ifdef HUFFMAN_IO_URING
+      while(true){
+        unsigned head = *cqHead;
+        if(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)){
+          io_uring_cqe* cqe = &cqes[head & *cqMask];
+          tag = cqe->user_data;
+          result = cqe->res;
+          __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+          inFlight--;
+          return true;
+        }
+        if(syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) return false;
+      }
+#endif
+      return false;
+    }
+    //waits for everything in flight and drops the results
+    void drain(){
+      uint64_t tag;
+      int64_t result;
+      while(this->wait(tag, result)){}
+    }
+    //the backend of streams opened from now on, e.g. THREADS to compare against io_uring
+    static void select(Backend backend){
+      choice() = backend;
+    }
+    static Backend selected(){
+      return Backend(choice().load());
+    }
+    static const char* name(Backend backend){
+      static const char* names[] = {"sync", "threads", "uring"};
+      return names[backend];
+    }
+    static bool parse(const char* name, Backend& backend){
+      for(int b=SYNC; b<=URING; b++){
+        if(strcmp(name, AsyncIO::name(Backend(b))) == 0){
+          backend = Backend(b);
+          return true;
+        }
+      }
+      return false;
+    }
+};
 
-bool comparePair(const std::pair<char,int>& o1, const std::pair<char,int>& o2){
-  return (o1.second > o2.second);
+//io_uring gives no order to reads or writes at the current position, so pipes go through the
+//worker thread, which takes requests in order
+static AsyncIO::Backend asyncBackend(AsyncIO::Backend backend, bool seekable){
+  return (backend == AsyncIO::URING && !seekable) ? AsyncIO::THREADS : backend;
 }
 
+//input stream buffer over a file descriptor that reads the next chunks while the current one is
+//consumed, DEPTH reads in flight; a read from a pipe is handed on as soon as it returns, however
+//short, so the data of a live producer is never held back
+//chunks are small enough for the copy out of them to stay in the cache
+class AsyncInput : public std::streambuf{
+  public:
+    static const size_t CHUNK_SIZE = 256 << 10;
+    static const unsigned int DEPTH = 8;
+  private:
+    enum State{FREE, READING, READY, HELD};
+    struct Chunk{
+      std::unique_ptr<unsigned char[]> data;
+      uint64_t offset = 0;
+      size_t length = 0;
+      State state = FREE;
+    };
+    int fd;
+    int64_t start; //file offset at opening, -1 for pipes and anything else without offsets
+    bool seekable;
+    AsyncIO io;
+    unsigned int limit; //of reads in flight, SYNC reads a pipe once at a time
+    Chunk chunks[DEPTH];
+    unsigned int next = 0; //chunk the next read goes into, chunks are read and handed out round robin
+    unsigned int current = 0; //chunk handed out next
+    unsigned int reading = 0;
+    uint64_t offset = 0; //of the next read in a regular file
+    uint64_t base = 0; //file offset of the get area
+    bool ended = false;
+    bool failed = false;
+    bool reported = false;
+    bool read(unsigned int i){
+      Chunk& c = chunks[i];
+      return io.submit(false, fd, c.data.get() + c.length, CHUNK_SIZE - c.length, seekable ? int64_t(c.offset + c.length) : -1, i);
+    }
+    //puts a read into every free chunk in turn
+    void fill(){
+      while(!ended && !failed && chunks[next].state == FREE && reading < limit){
+        Chunk& c = chunks[next];
+        c.offset = offset;
+        c.length = 0;
+        if(!this->read(next)){
+          failed = true;
+          return;
+        }
+        c.state = READING;
+        reading++;
+        offset += CHUNK_SIZE;
+        next = (next + 1) % DEPTH;
+      }
+    }
+    //takes one completion, a chunk of a regular file is read whole unless the file ends in it
+    void complete(){
+      uint64_t tag;
+      int64_t result;
+      if(!io.wait(tag, result)){
+        failed = true;
+        return;
+      }
+      Chunk& c = chunks[tag];
+      if(result < 0 && result != -EINTR){
+        errno = -result;
+        failed = true;
+      }else if(result >= 0){
+        c.length += result;
+        if(result == 0) ended = true;
+      }
+      if(!failed && (result == -EINTR || (seekable && result > 0 && c.length < CHUNK_SIZE))){
+        if(this->read(tag)) return;
+        failed = true;
+      }
+      c.state = READY;
+      reading--;
+    }
+  protected:
+    int_type underflow() override{
+      if(gptr() < egptr()) return traits_type::to_int_type(*gptr());
+      //the chunk just consumed takes the next read
+      if(eback() != NULL){
+        chunks[(current + DEPTH - 1) % DEPTH].state = FREE;
+        base += egptr() - eback();
+        setg(NULL, NULL, NULL);
+      }
+      this->fill();
+      while(chunks[current].state == READING && !failed) this->complete();
+      Chunk& c = chunks[current];
+      if(failed){
+        if(!reported) std::cerr << "Error in read: " << strerror(errno) << std::endl;
+        reported = true;
+        return traits_type::eof();
+      }
+      if(c.state != READY || c.length == 0) return traits_type::eof();
+      c.state = HELD;
+      setg((char*) c.data.get(), (char*) c.data.get(), (char*) c.data.get() + c.length);
+      current = (current + 1) % DEPTH;
+      //the next reads are under way while this chunk is consumed, SYNC would block on them here
+      if(io.backend() != AsyncIO::SYNC) this->fill();
+      return traits_type::to_int_type(*gptr());
+    }
+    //regular files only, a seek drops the reads ahead and starts over at the new position
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override{
+      if(!seekable || !(which & std::ios_base::in)) return pos_type(off_type(-1));
+      int64_t position = base + (gptr() - eback());
+      if(dir == std::ios_base::cur && off == 0) return pos_type(position);
+      struct stat st;
+      if(dir == std::ios_base::end && fstat(fd, &st) != 0) return pos_type(off_type(-1));
+      int64_t target = off + (dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? position : st.st_size);
+      if(target < 0) return pos_type(off_type(-1));
+      io.drain();
+      for(Chunk& c : chunks) c.state = FREE;
+      next = current = reading = 0;
+      offset = base = target;
+      ended = failed = false;
+      setg(NULL, NULL, NULL);
+      return pos_type(target);
+    }
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override{
+      return this->seekoff(off_type(position), std::ios_base::beg, which);
+    }
+  public:
+    AsyncInput(int fd, AsyncIO::Backend backend) : fd(fd), start(AsyncInput::position(fd, false)), seekable(start >= 0), io(asyncBackend(backend, seekable), DEPTH){
+      limit = (seekable || io.backend() != AsyncIO::SYNC) ? DEPTH : 1;
+      offset = base = (seekable ? start : 0);
+      for(Chunk& c : chunks) c.data.reset(new unsigned char[CHUNK_SIZE]);
+    }
+    //offset of a regular file, -1 for anything else and for output to a file opened for appending
+    static int64_t position(int fd, bool output){
+      struct stat st;
+      if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+      if(output && (fcntl(fd, F_GETFL) & O_APPEND)) return -1;
+      return lseek(fd, 0, SEEK_CUR);
+    }
+    AsyncInput(const AsyncInput&) = delete;
+    AsyncInput& operator=(const AsyncInput&) = delete;
+    //waits for the reads in flight, on a pipe until its producer writes or closes it
+    ~AsyncInput(){
+      io.drain();
+    }
+};
+
+//output stream buffer over a file descriptor that writes filled chunks while the next ones are
+//filled, DEPTH writes in flight, at their offsets in regular files and in order elsewhere,
+//a flush returns once everything is written
+class AsyncOutput : public std::streambuf{
+  public:
+    static const size_t CHUNK_SIZE = 256 << 10;
+    static const unsigned int DEPTH = 8;
+  private:
+    struct Chunk{
+      std::unique_ptr<unsigned char[]> data;
+      uint64_t offset = 0;
+      size_t length = 0;
+      size_t written = 0;
+      bool busy = false;
+    };
+    int fd;
+    int64_t start;
+    bool seekable;
+    AsyncIO io;
+    unsigned int limit;
+    Chunk chunks[DEPTH];
+    unsigned int current = 0; //chunk filled next
+    std::deque<unsigned int> waiting; //filled chunks behind those in flight, in order
+    unsigned int writing = 0;
+    uint64_t offset = 0; //of the next chunk in a regular file
+    bool failed = false;
+    bool write(unsigned int i){
+      Chunk& c = chunks[i];
+      if(!io.submit(true, fd, c.data.get() + c.written, c.length - c.written, seekable ? int64_t(c.offset + c.written) : -1, i)) return false;
+      writing++;
+      return true;
+    }
+    void startWaiting(){
+      while(!waiting.empty() && !failed && writing < limit){
+        if(!this->write(waiting.front())) failed = true;
+        waiting.pop_front();
+      }
+    }
+    //hands the put area on to be written
+    void queue(){
+      size_t length = pptr() - pbase();
+      setp(NULL, NULL);
+      if(length == 0) return;
+      Chunk& c = chunks[current];
+      c.offset = offset;
+      c.length = length;
+      c.written = 0;
+      c.busy = true;
+      offset += length;
+      waiting.push_back(current);
+      current = (current + 1) % DEPTH;
+      this->startWaiting();
+    }
+    //takes one completion, the rest of a short write goes out before anything behind it
+    void complete(){
+      uint64_t tag;
+      int64_t result;
+      if(!io.wait(tag, result)){
+        failed = true;
+        return;
+      }
+      writing--;
+      Chunk& c = chunks[tag];
+      if(result == 0 || (result < 0 && result != -EINTR)){
+        errno = (result < 0 ? -result : EIO);
+        failed = true;
+      }else if(result > 0){
+        c.written += result;
+      }
+      if(!failed && c.written < c.length){
+        if(this->write(tag)) return;
+        failed = true;
+      }
+      c.busy = false;
+      this->startWaiting();
+    }
+  protected:
+    int_type overflow(int_type ch) override{
+      if(pbase() != NULL) this->queue();
+      while(chunks[current].busy && !failed) this->complete();
+      if(failed) return traits_type::eof();
+      setp((char*) chunks[current].data.get(), (char*) chunks[current].data.get() + CHUNK_SIZE);
+      if(!traits_type::eq_int_type(ch, traits_type::eof())){
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+      }
+      return traits_type::not_eof(ch);
+    }
+    int sync() override{
+      if(pbase() != NULL) this->queue();
+      while(io.pending() > 0) this->complete();
+      waiting.clear();
+      //leaves the file position behind the data, as plain writes would
+      if(seekable) lseek(fd, offset, SEEK_SET);
+      return failed ? -1 : 0;
+    }
+  public:
+    AsyncOutput(int fd, AsyncIO::Backend backend) : fd(fd), start(AsyncInput::position(fd, true)), seekable(start >= 0), io(asyncBackend(backend, seekable), DEPTH){
+      limit = (seekable || io.backend() != AsyncIO::SYNC) ? DEPTH : 1;
+      offset = (seekable ? start : 0);
+      for(Chunk& c : chunks) c.data.reset(new unsigned char[CHUNK_SIZE]);
+    }
+    AsyncOutput(const AsyncOutput&) = delete;
+    AsyncOutput& operator=(const AsyncOutput&) = delete;
+    ~AsyncOutput(){
+      this->sync();
+    }
+};
 
 struct CLIOptions{
   int state = 0;
   bool extract = false; // -x
+  bool toStdout = false; // -c
   std::string archiveName; // -f archive.whz
   std::string fileName; // file.txt
+  std::vector<std::string> fileNames; // every file name given, members of a batch archive
+  bool batch = false; // -a, many files into one archive with a directory
+  std::string listName; // -T names.txt, member names one per line, "-" for stdin
+  bool list = false; // -L, prints the members of a batch archive
+  bool verify = false; // -t, decodes and checks the whole archive without writing anything
+  bool adaptive = false; // -A fgk|rebuild, single pass adaptive code, every read goes out as a frame
+  unsigned int adaptiveModel = Adaptive::MODEL_FGK;
+  unsigned int maxCodeLength = 0; // -l 12, 0 means no limit
+  uint32_t blockSize = 0; // -b 1024 (KiB), 0 means default
+  bool sharedTable = false; // -s
+  unsigned int sampleStride = 1; // -S 16, shared table from every 16th block only
+  unsigned int threads = 1; // -j 8, 0 means one per hardware thread
+  unsigned int streams = 1; // -i 4, interleaved bit streams per block
+  unsigned int contextTables = 0; // -o 16, order-1 context blocks with up to 16 tables
+  unsigned int transform = BlockArchive::TRANSFORM_NONE; // -p bwt, transform ahead of coding
+  bool extractRange = false; // -r 100:50
+  uint64_t rangeOffset = 0;
+  uint64_t rangeLength = 0;
+  bool stats = false; // --stats, phase timings and sizes on stderr
+  bool statsJson = false; // --stats=json, the same as one JSON object
+  AsyncIO::Backend io = AsyncIO::URING; // --io=threads, how streamed input and output are read ahead and written behind
+  // ./Huffman -a -f batch.whz a.txt b.txt c.txt   (batch archive with a directory)
+  // find dir -type f | ./Huffman -a -s -T - -f batch.whz   (names from stdin, one shared table)
+  // ./Huffman -xf batch.whz b.txt   (only member b.txt)
+  // ./Huffman -Lf batch.whz   (lists the members)
+  // ./Huffman -t -j 8 -f archive.whz   (checks every block on 8 threads, writes nothing)
   // ./Huffman -f archive.whz file.txt
+  // ./Huffman -l 12 file.txt   (codes at most 12 bits long)
+  // ./Huffman -s -b 4096 file.txt   (4 MiB blocks sharing one code table)
+  // ./Huffman -S 16 file.txt   (shared table estimated from every 16th block)
+  // ./Huffman -xf archive.whz -r 1000:200   (only bytes 1000-1199)
+  // ./Huffman -j 8 file.txt   (8 threads, -j 0 uses all hardware threads)
+  // ./Huffman -i 4 file.txt   (4 interleaved streams per block, faster to decode)
+  // ./Huffman -o 32 file.log   (code each byte by the one before it, up to 32 tables per block)
+  // ./Huffman -p bwt file.txt   (Burrows-Wheeler transform before coding, smaller for text)
+  // ./Huffman - < file.txt > archive.whz   ("-" is stdin/stdout)
+  // producer | ./Huffman -A rebuild - | consumer   (adaptive code, output flows as input arrives)
+  // ./Huffman -xcf archive.whz   (extracts to stdout)
   // ./Huffman file.txt   (-> file.txt.whz)
   // ./Huffman -xf archive.whz
+  // ./Huffman --stats=json file.txt   (timings per phase as JSON on stderr)
+  // ./Huffman --io=threads - < file.txt > archive.whz   (reads ahead on a thread instead of io_uring)
   void parseArgs(int argc, char** argv){
     for(int i=1; i<argc; i++){
       char* currentWord = argv[i];
       if(this->state == 0){
-        if(currentWord[0] == '-'){
+        if(strcmp(currentWord, "--stats") == 0 || strcmp(currentWord, "--stats=json") == 0){
+          this->stats = true;
+          this->statsJson = (currentWord[7] == '=');
+        }else if(strncmp(currentWord, "--io=", 5) == 0){
+          if(!AsyncIO::parse(currentWord + 5, this->io)){
+            std::cerr << "I/O backend has to be uring, threads or sync!" << std::endl;
+            exit(1);
+          }
+        }else if(strncmp(currentWord, "--", 2) == 0){
+          std::cerr << "Unknown parameter '" << currentWord << "'!" << std::endl;
+          exit(1);
+        }else if(currentWord[0] == '-' && currentWord[1] != '\0'){
           //parse flags
           currentWord++;
           while(*currentWord != '\0'){
             if(*currentWord == 'x'){
               this->extract = true;
+            }else if(*currentWord == 'c'){
+              this->toStdout = true;
             }else if(*currentWord == 'f'){
               this->state = 1; //next word is archiveName
+            }else if(*currentWord == 'l'){
+              this->state = 2; //next word is maxCodeLength
+            }else if(*currentWord == 'b'){
+              this->state = 3; //next word is blockSize
+            }else if(*currentWord == 'r'){
+              this->state = 4; //next word is offset:length
+            }else if(*currentWord == 's'){
+              this->sharedTable = true;
+            }else if(*currentWord == 'S'){
+              this->sharedTable = true;
+              this->state = 6; //next word is sampleStride
+            }else if(*currentWord == 'j'){
+              this->state = 5; //next word is threads
+            }else if(*currentWord == 'i'){
+              this->state = 7; //next word is streams
+            }else if(*currentWord == 'o'){
+              this->state = 8; //next word is contextTables
+            }else if(*currentWord == 'p'){
+              this->state = 9; //next word is the transform
+            }else if(*currentWord == 'a'){
+              this->batch = true;
+            }else if(*currentWord == 'T'){
+              this->batch = true;
+              this->state = 10; //next word is listName
+            }else if(*currentWord == 'A'){
+              this->adaptive = true;
+              this->state = 11; //next word is the adaptive model
+            }else if(*currentWord == 'L'){
+              this->list = true;
+              this->extract = true;
+            }else if(*currentWord == 't'){
+              this->verify = true;
+              this->extract = true;
             }else if(*currentWord == 'h'){
               CLIOptions::printHelpAndExit(argc, argv);
             }else{
@@ -54,443 +640,223 @@ struct CLIOptions{
         }else{
             //parse fileName
             this->fileName = std::string(currentWord);
+            this->fileNames.push_back(this->fileName);
         }
       }else if(this->state == 1){
         this->archiveName = std::string(currentWord);
         this->state = 0;
+      }else if(this->state == 2){
+        int length = atoi(currentWord);
+        if(length < 1 || length > 64){
+          std::cerr << "Code length limit has to be between 1 and 64!" << std::endl;
+          exit(1);
+        }
+        this->maxCodeLength = length;
+        this->state = 0;
+      }else if(this->state == 3){
+        long kib = atol(currentWord);
+        if(kib < 1 || kib > 1024*1024){
+          std::cerr << "Block size has to be between 1 and 1048576 KiB!" << std::endl;
+          exit(1);
+        }
+        this->blockSize = kib * 1024;
+        this->state = 0;
+      }else if(this->state == 4){
+        char* colon = strchr(currentWord, ':');
+        if(colon == NULL){
+          std::cerr << "Range has to be given as offset:length!" << std::endl;
+          exit(1);
+        }
+        this->rangeOffset = strtoull(currentWord, NULL, 10);
+        this->rangeLength = strtoull(colon + 1, NULL, 10);
+        this->extractRange = true;
+        this->state = 0;
+      }else if(this->state == 5){
+        int threads = atoi(currentWord);
+        if(threads < 0 || threads > 1024){
+          std::cerr << "Thread count has to be between 0 and 1024!" << std::endl;
+          exit(1);
+        }
+        this->threads = threads;
+        this->state = 0;
+      }else if(this->state == 6){
+        int stride = atoi(currentWord);
+        if(stride < 1){
+          std::cerr << "Sample stride has to be at least 1!" << std::endl;
+          exit(1);
+        }
+        this->sampleStride = stride;
+        this->state = 0;
+      }else if(this->state == 7){
+        int streams = atoi(currentWord);
+        if(streams < 1 || streams > 8){
+          std::cerr << "Stream count has to be between 1 and 8!" << std::endl;
+          exit(1);
+        }
+        this->streams = streams;
+        this->state = 0;
+      }else if(this->state == 8){
+        int tables = atoi(currentWord);
+        if(tables < 2 || tables > (int)ContextModel::MAX_TABLES){
+          std::cerr << "Context table count has to be between 2 and " << ContextModel::MAX_TABLES << "!" << std::endl;
+          exit(1);
+        }
+        this->contextTables = tables;
+        this->state = 0;
+      }else if(this->state == 9){
+        if(strcmp(currentWord, "none") == 0){
+          this->transform = BlockArchive::TRANSFORM_NONE;
+        }else if(strcmp(currentWord, "bwt") == 0){
+          this->transform = BlockArchive::TRANSFORM_BWT;
+        }else{
+          std::cerr << "Transform has to be none or bwt!" << std::endl;
+          exit(1);
+        }
+        this->state = 0;
+      }else if(this->state == 10){
+        this->listName = std::string(currentWord);
+        this->state = 0;
+      }else if(this->state == 11){
+        if(strcmp(currentWord, "fgk") == 0){
+          this->adaptiveModel = Adaptive::MODEL_FGK;
+        }else if(strcmp(currentWord, "rebuild") == 0){
+          this->adaptiveModel = Adaptive::MODEL_REBUILD;
+        }else{
+          std::cerr << "Adaptive model has to be fgk or rebuild!" << std::endl;
+          exit(1);
+        }
+        this->state = 0;
       }
     }
   }
   static void printHelpAndExit(int argc, char** argv){
-    std::cout << "Usage: " << argv[0] << " [-x] [-f archiveName] fileName" << std::endl;
+    std::cout << "Usage: " << argv[0] << " [--stats[=json]] [--io=uring|threads|sync] [-s | -S sampleStride] [-b blockSizeKiB] [-l maxCodeLength] [-i streams] [-o contextTables] [-p none|bwt] [-j threads] [-f archiveName] fileName" << std::endl;
+    std::cout << "       " << argv[0] << " [--stats[=json]] [--io=uring|threads|sync] -A fgk|rebuild [-f archiveName] fileName" << std::endl;
+    std::cout << "       " << argv[0] << " [--stats[=json]] -a [-s | -S sampleStride] [options as above] [-T listFile] -f archiveName fileName..." << std::endl;
+    std::cout << "       " << argv[0] << " [--stats[=json]] [--io=uring|threads|sync] -x [-c] [-r offset:length] [-j threads] -f archiveName [member...]" << std::endl;
+    std::cout << "       " << argv[0] << " [--stats[=json]] -t [-j threads] -f archiveName" << std::endl;
+    std::cout << "       " << argv[0] << " -L -f archiveName" << std::endl;
     exit(0);
   }
 };
 
-class BitSymbol{
-  private:
-    unsigned char length = 0;
-    uint64_t data = 0;
-    unsigned char iteratorPtr = 0;
-  public:
-    void add(bool bit){
-      data |= (bit ? (uint64_t(1) << (63-length) ) : 0);
-      length++;
-    }
-    void resetIterator(){
-      iteratorPtr = 0;
-    }
-    bool hasNext(){
-      return iteratorPtr < length;
-    }
-    bool getNext(){
-      return data & (uint64_t(1) << (63 - (iteratorPtr++) ));
-    }
-    std::string getAsString() const {
-      std::string ret;
-      for(unsigned char i=0; i<length; i++){
-        ret += (data & (uint64_t(1) << (63 - i)) ? "1" : "0");
-      }
-      return ret;
-    }
-    unsigned char getLength() const {
-      return length;
-    }
-    bool equalsN(const BitSymbol &other, unsigned char n){
-      uint64_t mask = 0;
-      for(unsigned char i=0; i<n; i++){
-        mask |= (uint64_t(1) << (63 - i));
-      }
-      return (this->data & mask) == (other.data & mask);
-    }
-    bool operator==(const BitSymbol o2) const {
-      return (this->data == o2.data && this->length == o2.length);
-    }
-    bool operator<(const BitSymbol o2) const {
-      return this->data < o2.data;
-    }
-    bool getLSB(){
-      if(length==0) return false;
-      return data & (uint64_t(1) << (64-length) );
-    }
-};
 
-class BitStream{
+//a whole file mapped into memory, either read-only or created with a known size for writing
+class MappedFile{
   private:
-    std::vector<unsigned char> bytes;
-    unsigned char tmp = 0;
-    char ptr = 0;
+    int fd = -1;
+    unsigned char* data = NULL;
+    size_t length = 0;
   public:
-    static BitStream createFromString(const std::string& str, unsigned int startIndex=0){
-      BitStream bs;
-      for(unsigned int i=startIndex; i<str.length(); i++){
-        bs.bytes.push_back(str[i]);
-      }
-      return bs;
-    }
-    void add(bool symbol){
-      tmp |= (symbol ? (0x01 << (7-ptr) ) : 0);
-      ptr++;
-      if(ptr > 7){
-        ptr = 0;
-        bytes.push_back(tmp);
-        tmp = 0;
-      }
-    }
-    void addByte(unsigned char add){
-      this->bytes.push_back(add);
-    }
-    void finalize(){
-      while(ptr > 0) this->add(1);
-    }
-    std::vector<unsigned char> &getData(){
-      return this->bytes;
-    }
-    std::string getAsString(){
-      std::string ret;
-      for(unsigned char b : this->bytes) ret += b;
-      return ret;
-    }
-    unsigned int getLength() const {
-      return bytes.size()*8 + ptr;
-    }
-    BitSymbol getSubBits(unsigned int start, unsigned int length){
-      unsigned int startByte = start/8;
-      unsigned int startBit = start%8;
-      unsigned int endByte = (start+length-1)/8;
-      unsigned int endBit = (start+length-1)%8;
-      BitSymbol bs;
-      for(unsigned int byteNum=startByte; byteNum<=endByte; byteNum++){
-        if(byteNum >= this->bytes.size()) break;
-        unsigned int bitStart = 0;
-        if(byteNum == startByte) bitStart = startBit;
-        unsigned int bitEnd = 7;
-        if(byteNum == endByte) bitEnd = endBit;
-        for(unsigned int bitNum=bitStart; bitNum<=bitEnd; bitNum++){
-          bs.add(this->bytes[byteNum] & (0x01 << (7-bitNum)));
-        }
-      }
-      return bs;
-    }
-    bool getSubBit(unsigned int index){
-      unsigned int byteNum = index/8;
-      unsigned int bitNum = index%8;
-      if(byteNum >= this->bytes.size()) return false;
-      return this->bytes[byteNum] & ( 0x01 << (7-bitNum) );
+    MappedFile(){}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile(){
+      this->close();
     }
-};
-
-class Huffman{
-  private:
-    static std::map<BitSymbol,char> generateSymbols(const std::vector<std::pair<char,int>> &sortedSymbolFrequencies){
-      std::cout << "Count of different symbols: " << sortedSymbolFrequencies.size() << std::endl;
-      std::vector<BitSymbol> bitSymbols;
-      unsigned int charCount = 0;
-      for(unsigned int i=0; i<sortedSymbolFrequencies.size(); i++){
-        charCount += sortedSymbolFrequencies[i].second;
-        BitSymbol bs;
-        bitSymbols.push_back(bs);
-      }
-
-      int depth = 0;
-      while(true && depth < 64){
-        //int i=0; //only for DEBUG
-        depth++;
-        bool add = 0;
-        unsigned int pi = 0;
-        int compoundShare = 0;
-        bool allFinal = true;
-        bool lastLSB = 1;
-        int bucketHalf;
-        int bucketRelative;
-        int bucketNumber = -1;
-        for(const auto &p : sortedSymbolFrequencies){
-          int share = p.second;
-          compoundShare += share;
-          //bool flipped = false; //only for DEBUG
-          //bool finalSymbol = false; //only for DEBUG
-          bool flagFirstInBucket = false;
-          if(bitSymbols[pi].getLSB() != lastLSB){ //bucket changed
-            bucketNumber++;
-            lastLSB = bitSymbols[pi].getLSB();
-            add = 0;
-            flagFirstInBucket = true;
-            //find next bucket
-            int thisBucketCompound = share;
-            for(unsigned int pj = pi+1; pj < sortedSymbolFrequencies.size(); pj++){
-              if(bitSymbols[pj].getLSB() != bitSymbols[pi].getLSB()) break;
-              thisBucketCompound += sortedSymbolFrequencies[pj].second;
-            }
-            bucketHalf = (thisBucketCompound)/2;
-            bucketRelative = 0;
-            if(share >= bucketHalf){
-              bucketHalf = share;
-            }
-          }
-          bucketRelative += share;
-          if(bucketRelative >= bucketHalf && !flagFirstInBucket && !add){ //half bucket exceeded -> flip to 1
-            add = 1;
-            //flipped = true; //only for DEBUG
-          }
-
-          //check if it is done already
-          bool differentThanNeighbors = true;
-          if(pi > 0){ //has prev neighbor
-            if(bitSymbols[pi].equalsN(bitSymbols[pi-1], bitSymbols[pi].getLength())) differentThanNeighbors = false;
-          }
-          if(pi < bitSymbols.size() - 1){ //has next neighbor
-            if(bitSymbols[pi].equalsN(bitSymbols[pi+1], bitSymbols[pi].getLength())) differentThanNeighbors = false;
-          }
-
-          if(!differentThanNeighbors){ //not done - add a next bit
-            bitSymbols[pi].add(add);
-            allFinal = false;
-          }/*else{ //this bit symbol is final
-            finalSymbol = true; //only for DEBUG
-          }*/
-          /*std::cout << std::setw(2) << i++ << "| " << p.first << "(" << std::hex << ((int)p.first) << std::dec << ")"
-                    << " -> " << std::setw(4) << p.second << "\t" << " (" << share << ") "
-                    << compoundShare << "  B(" << bucketNumber << " : " << bucketRelative << " H" << bucketHalf << ")"
-                    << "\t" << bitSymbols[pi].getAsString() << " " << (flipped ? "_" : "")
-                    << (finalSymbol ? " F" : "") << std::endl; //only for DEBUG */
-          pi++;
-        }
-        if(allFinal){
-          //std::cout << " - - - ALL FINAL: WE ARE DONE - - - " << std::endl;
-          break;
-        }
+    //maps an existing regular file, false if it is none or cannot be mapped
+    //sequential tells the kernel to read ahead aggressively and drop pages behind
+    bool openRead(const char* filename, bool sequential = true){
+      fd = ::open(filename, O_RDONLY);
+      if(fd < 0) return false;
+      struct stat st;
+      if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+        this->close();
+        return false;
       }
-
-      std::map<BitSymbol,char> symbolSubstMap;
-      for(unsigned int i = 0; i < sortedSymbolFrequencies.size(); i++){
-        char c = sortedSymbolFrequencies[i].first;
-        BitSymbol bitSymbol = bitSymbols[i];
-        std::cout << std::setw(2) << std::dec << i << " | '" << c << "' (" << std::hex << ((int)c) << ") [" << std::dec << sortedSymbolFrequencies[i].second << "] -> " << bitSymbol.getAsString() << std::endl;
-        symbolSubstMap[bitSymbol] = c;
+      length = st.st_size;
+      if(length == 0) return true;
+      void* p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p == MAP_FAILED){
+        this->close();
+        return false;
       }
-
-      return symbolSubstMap;
+      data = (unsigned char*) p;
+      madvise(data, length, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+      return true;
     }
-  public:
-    static std::pair<BitStream,std::map<BitSymbol,char>> strEncode(std::string in){
-      unsigned int inLength = in.length();
-      std::map<char,int> symbolFrequencies;
-      unsigned int charCount = 0;
-      for(std::string::iterator it=in.begin(); it!=in.end(); ++it){
-        char c = *it;
-        //std::cout << "in: '" << c << "' (" << std::hex << ((int)c) << ")" << std::endl;
-        symbolFrequencies[c]++;
-        charCount++;
-      }
-      std::vector<std::pair<char,int>> symbolsSort;
-      //std::vector<BitSymbol> bitSymbols;
-      for(const std::pair<char,int> &p : symbolFrequencies){
-        symbolsSort.push_back(p);
-        //BitSymbol bs;
-        //bitSymbols.push_back(bs);
-      }
-      std::sort(symbolsSort.begin(), symbolsSort.end(), comparePair);
-
-      //sorted, now generate symbols
-      std::map<BitSymbol,char> symbolSubstMap = Huffman::generateSymbols(symbolsSort);
-      int i = 0;
-      for(const std::pair<BitSymbol,char> &p : symbolSubstMap){
-        std::cout << std::setw(2) << i++ << " subst: " << p.first.getAsString() << " ~> '" << p.second << "'" << std::endl;
+    //creates or truncates the file to size bytes and maps it for writing; the space is reserved
+    //first, a full disk would otherwise only show as SIGBUS on a store to the mapping, so if it
+    //cannot be reserved the file is removed again
+    bool createWrite(const char* filename, size_t size){
+      fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if(fd < 0) return false;
+      int reserved = size > 0 ? posix_fallocate(fd, 0, size) : 0;
+      if(reserved != 0){
+        this->close();
+        ::unlink(filename);
+        errno = reserved;
+        return false;
       }
-      //we have all symbols generated
-
-      BitStream bitStream;
-      uint64_t progress = 0;
-      std::cout << "Progress:" << std::endl;
-      for(std::string::iterator it=in.begin(); it!=in.end(); ++it){
-        //foreach char
-        char c = *it;
-        progress++;
-        if(progress % 300 == 0){
-          uint64_t percentage = uint64_t(10000) * progress / inLength;
-          uint64_t percentageInt = percentage / 100;
-          uint64_t percentageSub = percentage % 100;
-          std::cout << "\r " << std::dec << percentageInt << "." << (percentageSub < 10 ? "0" : "") << percentageSub << "% ";
-        }
-        bool substFound = false;
-        //find symbol
-        for(const std::pair<BitSymbol,char> &symbolSubst : symbolSubstMap){
-          if(symbolSubst.second != c) continue;
-          //we have current index of current character
-          //fetch our symbol:
-          BitSymbol currentSymbol = symbolSubst.first;
-          currentSymbol.resetIterator();
-          while(currentSymbol.hasNext()){
-            bitStream.add(currentSymbol.getNext());
-          }
-          substFound = true;
-          break;
-        }
-        if(!substFound){ //error
-          std::cout << "Error! Substitution for '" << c << "' (" << std::hex << ((int)c) << ") not found!" << std::endl;
-        }
+      length = size;
+      if(length == 0) return true;
+      void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(p == MAP_FAILED){
+        this->close();
+        return false;
       }
-      bitStream.finalize();
-
-
-      std::vector<unsigned char> rawBytes = bitStream.getData();
-      unsigned int outLength = rawBytes.size();
-      /*for(unsigned char b : rawBytes){
-        std::cout << "-- ";
-        binDump(b);
-      }*/
-      std::cout << "Input length: " << inLength << ", output length: " << outLength << std::endl;
-      return std::make_pair(bitStream, symbolSubstMap);
+      data = (unsigned char*) p;
+      madvise(data, length, MADV_SEQUENTIAL);
+      return true;
     }
-
-    static std::string strDecode(BitStream enc, std::map<BitSymbol,char> symbolSubstMap){
-      unsigned int stringPos = 0;
-      unsigned int encLength = enc.getLength();
-      unsigned int progress = 0;
-      std::string dec = "";
-      //faster lookup table
-      std::vector<BitSymbol> substKeys;
-      std::vector<char> substValues;
-      for(const std::pair<BitSymbol,char> &p : symbolSubstMap){
-        substKeys.push_back(p.first);
-        substValues.push_back(p.second);
-      }
-      unsigned int substMapSize = substKeys.size();
-      std::cout << "Progress:" << std::endl;
-      while(true){
-        progress++;
-        if(progress % 300 == 0){
-          uint64_t percentage = uint64_t(10000) * stringPos / encLength;
-          uint64_t percentageInt = percentage / 100;
-          uint64_t percentageSub = percentage % 100;
-          std::cout << "\r " << std::dec << percentageInt << "." << (percentageSub < 10 ? "0" : "") << percentageSub << "% ";
-        }
-        bool foundSymbol = false;
-        for(unsigned int i=0; i<substMapSize; i++){
-          unsigned int symbolLen = (unsigned int) substKeys[i].getLength();
-          BitSymbol symbol = enc.getSubBits(stringPos, symbolLen);
-          if(substKeys[i] == symbol){ //symbol found
-            dec += substValues[i];
-            stringPos += symbolLen;
-            //std::cout << "Matched char '" << substValues[i] << "'!" << std::endl;
-            foundSymbol = true;
-            break;
-          }
-        }
-        /*for(const std::pair<BitSymbol,char> &p : symbolSubstMap){
-          unsigned int symbolLen = (unsigned int) p.first.getLength();
-          BitSymbol symbol = enc.getSubBits(stringPos, symbolLen);
-          if(p.first == symbol){ //symbol found
-            dec += p.second;
-            stringPos += symbolLen;
-            //std::cout << "Matched char '" << p.second << "'!" << std::endl;
-            foundSymbol = true;
-            break;
-          }
-        }*/
-        if(!foundSymbol){
-          std::cout << "Symbol not matched! stringPos=" << stringPos << std::endl;
-          break;
-        }
-        if(enc.getLength() <= stringPos){
-          std::cout << "End reached! enc.getLength()=" << enc.getLength() << " <= stringPos=" << stringPos << std::endl;
-          break;
-        }
-      }
-      return dec;
+    unsigned char* getData() const {
+      return data;
     }
-
-    static std::string serialize(BitStream bitStream, std::map<BitSymbol,char> symbolSubstMap){
-      std::string ret = "";
-      ret += ((unsigned char)0xAD); //header part 1
-      ret += ((unsigned char)0xBD); //header part 2
-      ret += ((unsigned char)0x01); //version 1
-      ret += ((unsigned char)(symbolSubstMap.size())); //number of substitution symbol
-      //table of subst symbols
-      BitStream symbolMapStream;
-      for(std::pair<BitSymbol,char> p : symbolSubstMap){
-        //char (8b), symbolSize (6b), symbol (Xb)
-        for(int i=0; i<8; i++)
-          symbolMapStream.add(p.second & (0x01 << (7-i) ));
-        unsigned char symbolSize = p.first.getLength();
-        for(int i=2; i<8; i++)
-          symbolMapStream.add(symbolSize & (0x01 << (7-i) ));
-        p.first.resetIterator();
-        while(p.first.hasNext())
-          symbolMapStream.add(p.first.getNext());
-      }
-      symbolMapStream.finalize();
-      const std::vector<unsigned char> &symbols =  symbolMapStream.getData();
-      for(const unsigned char &c : symbols){
-        ret += c;
-      }
-      //raw compressed data
-      //maybe 8 B of compressed data length
-      bitStream.finalize(); //just to be sure
-      const std::vector<unsigned char> &symbolCharacters =  bitStream.getData();
-      for(const unsigned char &c : symbolCharacters){
-        ret += c;
-      }
-      return ret;
+    //drops the pages before end of a file opened with openRead from memory, they are read
+    //again from the file if touched
+    void release(size_t end) const {
+      size_t page = sysconf(_SC_PAGESIZE);
+      if(data != NULL && end >= page) madvise(data, std::min(end, length) / page * page, MADV_DONTNEED);
     }
-
-    static std::pair<BitStream,std::map<BitSymbol,char>> deserialize(const std::string& serial){
-      if(serial.length() < 4) return std::make_pair<BitStream,std::map<BitSymbol,char>>(BitStream(),std::map<BitSymbol,char>()); //invalid header
-      if(((unsigned char)serial[0]) != 0xAD || ((unsigned char)serial[1]) != 0xBD) return std::make_pair<BitStream,std::map<BitSymbol,char>>(BitStream(),std::map<BitSymbol,char>()); //invalid format
-      if(serial[2] != 0x01) return std::make_pair<BitStream,std::map<BitSymbol,char>>(BitStream(),std::map<BitSymbol,char>()); //not supported format version
-      // /\ these will be exceptions
-      
-      for(int i=0; i<16; i++){
-        std::cout << std::hex << ((unsigned int)serial[i]) << " ";
-      }
-      std::cout << std::endl;
-      
-      unsigned int symbolSubstMapSize = (unsigned char)serial[3]; // 0 means 256
-      if(symbolSubstMapSize == 0) symbolSubstMapSize = 256;
-      std::map<BitSymbol,char> symbolSubstMap;
-      BitStream bitStream = BitStream::createFromString(serial, 4);
-      unsigned int bitCount = 0;
-      //parse symbol substitution map
-      for(unsigned int i=0; i<symbolSubstMapSize; i++){
-        //char (8b), symbolSize (6b), symbol (Xb)
-        char c = 0;
-        for(int j=0; j<8; j++){
-          c |= (bitStream.getSubBit(bitCount++) ? (0x01 << (7-j) ) : 0);
-        }
-        unsigned char symbolSize = 0;
-        for(int j=0; j<6; j++){
-          bool got = bitStream.getSubBit(bitCount++);
-          symbolSize |= (got ? (0x01 << (5-j) ) : 0);
-        }
-        if(symbolSize == 0) symbolSize = 64;
-        BitSymbol bitSymbol;
-        for(unsigned char j=0; j<symbolSize; j++){
-          bitSymbol.add(bitStream.getSubBit(bitCount++));
-        }
-        symbolSubstMap[bitSymbol] = c;
-        std::cout << "D" << std::dec << std::setw(2) << (unsigned int)i << " subst: " << bitSymbol.getAsString() << " ~> '" << c << "'" << std::endl;
-      }
-      //discard padding to next byte
-      while(bitCount % 8 != 0) bitCount++;
-      //copy data
-      BitStream dataBitStream;
-      unsigned int dataStart = 4 + bitCount/8;
-      for(unsigned int i=dataStart; i<serial.length(); i++){
-        dataBitStream.addByte(serial[i]);
-      }
-      return std::make_pair(dataBitStream, symbolSubstMap);
+    size_t getLength() const {
+      return length;
+    }
+    //unmaps a file opened with createWrite and cuts it to size bytes
+    bool close(size_t size){
+      if(data != NULL) munmap(data, length);
+      data = NULL;
+      bool ok = (fd >= 0 && ftruncate(fd, size) == 0);
+      this->close();
+      return ok;
+    }
+    void close(){
+      if(data != NULL) munmap(data, length);
+      if(fd >= 0) ::close(fd);
+      data = NULL;
+      fd = -1;
+      length = 0;
     }
 };
 
-
+//a file given by name, "-" stands for stdin/stdout
 class File{
   private:
     const char* filename;
+    std::ifstream inStream;
+    int fd = -1;
+    std::unique_ptr<AsyncInput> asyncInput;
+    std::unique_ptr<AsyncOutput> asyncOutput;
+    std::istream asyncInStream{NULL};
+    std::ostream asyncOutStream{NULL};
   public:
     File(const char* f){
       this->filename = f;
     }
+    ~File(){
+      asyncInput.reset();
+      asyncOutput.reset();
+      if(fd >= 0) ::close(fd);
+    }
+    bool isStandardStream() const {
+      return strcmp(this->filename, "-") == 0;
+    }
+    //regular files only, pipes, FIFOs and process substitutions are read once
+    bool isSeekable() const {
+      struct stat st;
+      return !this->isStandardStream() && stat(this->filename, &st) == 0 && S_ISREG(st.st_mode);
+    }
     string read(){
+      if(this->isStandardStream()) return std::string(std::istreambuf_iterator<char>(std::cin), {});
       string c;
       fstream fs;
       fs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -505,6 +871,15 @@ class File{
       return c;
     }
     bool write(const string& w){
+      if(this->isStandardStream()){
+        std::cout << w;
+        std::cout.flush();
+        if(!std::cout){
+          cerr << "Error in write: " << strerror(errno) << std::endl;
+          return false;
+        }
+        return true;
+      }
       fstream fs;
       fs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
       try{
@@ -524,56 +899,804 @@ class File{
       fs<<w;
       fs.close();
     }
+    //stream for reading the file in chunks, NULL if it cannot be opened
+    //sequential reads are read ahead on AsyncIO while the caller codes, others go through ifstream
+    std::istream* openRead(bool sequential = true){
+      if(sequential){
+        int inFd = 0;
+        if(!this->isStandardStream()){
+          fd = ::open(this->filename, O_RDONLY);
+          if(fd < 0){
+            cerr << "Error in read: " << strerror(errno) << std::endl;
+            return NULL;
+          }
+          inFd = fd;
+        }
+        asyncInput.reset(new AsyncInput(inFd, AsyncIO::selected()));
+        asyncInStream.rdbuf(asyncInput.get());
+        return &asyncInStream;
+      }
+      if(this->isStandardStream()) return &std::cin;
+      inStream.open(this->filename, ios_base::in | ios_base::binary);
+      if(!inStream.is_open()){
+        cerr << "Error in read: " << strerror(errno) << std::endl;
+        return NULL;
+      }
+      return &inStream;
+    }
+    //stream for writing the file in chunks, NULL if it cannot be created
+    //filled chunks are written on AsyncIO while the next ones are coded, flush waits for them
+    std::ostream* openWrite(){
+      int outFd = 1;
+      if(!this->isStandardStream()){
+        fd = ::open(this->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+          cerr << "Error in write: " << strerror(errno) << std::endl;
+          return NULL;
+        }
+        outFd = fd;
+      }
+      asyncOutput.reset(new AsyncOutput(outFd, AsyncIO::selected()));
+      asyncOutStream.rdbuf(asyncOutput.get());
+      return &asyncOutStream;
+    }
+};
+
+//batch archives: many files back to back in one archive, so small files share code tables,
+//with a directory of names, offsets and sizes from which any member is extracted by decoding
+//only the blocks holding it
+class Batch{
+  private:
+    //smaller than for single files, a member is extracted by decoding the blocks it touches
+    static const uint32_t DEFAULT_BLOCK_SIZE = 64 << 10;
+    static const uint64_t RUN_SIZE = 8 << 20; //of members decoded at once
+    //reads exactly size bytes, false on errors or if the file ends early
+    static bool readFile(int fd, unsigned char* buffer, size_t size){
+      while(size > 0){
+        ssize_t got = ::read(fd, buffer, size);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        buffer += got;
+        size -= got;
+      }
+      return true;
+    }
+    static bool writeFile(int fd, const unsigned char* data, size_t size){
+      while(size > 0){
+        ssize_t put = ::write(fd, data, size);
+        if(put < 0 && errno == EINTR) continue;
+        if(put <= 0) return false;
+        data += put;
+        size -= put;
+      }
+      return true;
+    }
+    //the name a file is stored under: its path without leading slashes and without empty, '.'
+    //and '..' components, so that every member extracts below the current directory
+    static std::string memberName(const std::string& name, bool& dotDot){
+      std::string member;
+      size_t start = 0;
+      while(start <= name.length()){
+        size_t end = name.find('/', start);
+        if(end == std::string::npos) end = name.length();
+        if(name.compare(start, end - start, "..") == 0) dotDot = true;
+        if(end > start && name.compare(start, end - start, ".") != 0 && name.compare(start, end - start, "..") != 0){
+          if(!member.empty()) member += '/';
+          member.append(name, start, end - start);
+        }
+        start = end + 1;
+      }
+      return member;
+    }
+    //names on the command line and in the list file, without duplicates and without names that
+    //would be stored the same
+    static bool memberNames(const CLIOptions& options, std::vector<std::string>& names){
+      std::vector<std::string> given = options.fileNames;
+      if(options.listName.length() > 0){
+        std::ifstream listFile;
+        std::istream* list = &std::cin;
+        if(options.listName != "-"){
+          listFile.open(options.listName);
+          if(!listFile.is_open()){
+            std::cerr << "Error in read: " << strerror(errno) << std::endl;
+            return false;
+          }
+          list = &listFile;
+        }
+        std::string line;
+        while(std::getline(*list, line)){
+          if(line.length() > 0) given.push_back(line);
+        }
+      }
+      std::unordered_map<std::string, bool> seen;
+      bool stripped = false;
+      bool dotDotRemoved = false;
+      for(std::string& name : given){
+        bool dotDot = false;
+        std::string member = Batch::memberName(name, dotDot);
+        if(member.empty()) continue;
+        if(name[0] == '/' && !stripped){
+          std::cerr << "Removing leading '/' from member names" << std::endl;
+          stripped = true;
+        }
+        if(dotDot && !dotDotRemoved){
+          std::cerr << "Removing '..' from member names" << std::endl;
+          dotDotRemoved = true;
+        }
+        if(seen.count(member)){
+          std::cerr << "Skipping '" << name << "', it is already a member!" << std::endl;
+          continue;
+        }
+        seen[member] = true;
+        names.push_back(name);
+      }
+      return true;
+    }
+    //member names are written below the current directory only
+    static bool safeName(const std::string& name){
+      if(name.empty() || name[0] == '/') return false;
+      size_t start = 0;
+      while(start <= name.length()){
+        size_t end = name.find('/', start);
+        if(end == std::string::npos) end = name.length();
+        if(name.compare(start, end - start, "..") == 0) return false;
+        start = end + 1;
+      }
+      return true;
+    }
+    //creates the directories leading to a member, lastDirectory skips the ones just created
+    static void makeParents(const std::string& name, std::string& lastDirectory){
+      size_t slash = name.rfind('/');
+      if(slash == std::string::npos) return;
+      std::string parent = name.substr(0, slash);
+      if(parent == lastDirectory) return;
+      for(size_t pos = parent.find('/'); ; pos = parent.find('/', pos + 1)){
+        mkdir(parent.substr(0, pos).c_str(), 0755);
+        if(pos == std::string::npos) break;
+      }
+      lastDirectory = parent;
+    }
+  public:
+    static bool isBatch(const unsigned char* archive, size_t length){
+      return length > 3 && BlockArchive::isArchive(archive, length) && (archive[3] & BlockArchive::FLAG_DIRECTORY);
+    }
+    //codes the files given in options into a batch archive, false on errors
+    static bool compress(const CLIOptions& options, ThreadPool& pool, Stats* stats){
+      std::vector<std::string> names;
+      if(!Batch::memberNames(options, names)) return false;
+      BlockArchive::Settings settings;
+      settings.blockSize = options.blockSize ? options.blockSize : DEFAULT_BLOCK_SIZE;
+      settings.maxCodeLength = options.maxCodeLength;
+      settings.streams = options.streams;
+      settings.contextTables = options.contextTables;
+      settings.transform = options.transform;
+      settings.batch = true;
+      settings.stats = stats;
+      std::vector<unsigned char> buffer(size_t(settings.blockSize) * pool.size());
+      //a shared table is trained on every sampleStride-th file, with a count for every
+      //byte value so it can code any member
+      unsigned char sharedLengths[256];
+      bool sharedTable = options.sharedTable;
+      if(sharedTable && options.transform != BlockArchive::TRANSFORM_NONE){
+        std::cerr << "A shared table is counted on untransformed bytes, using a table per block!" << std::endl;
+        sharedTable = false;
+      }
+      if(sharedTable){
+        Stats::Timer histogramTimer(stats, Stats::HISTOGRAM);
+        uint64_t frequencies[256] = {0};
+        for(size_t i=0; i<names.size(); i+=options.sampleStride){
+          int fd = ::open(names[i].c_str(), O_RDONLY);
+          if(fd < 0) continue; //reported by the second pass
+          while(true){
+            ssize_t got = ::read(fd, buffer.data(), buffer.size());
+            if(got <= 0) break;
+            Histogram::count(buffer.data(), got, frequencies);
+          }
+          ::close(fd);
+        }
+        for(int c=0; c<256; c++) frequencies[c] = std::max<uint64_t>(frequencies[c], 1);
+        histogramTimer.stop();
+        Stats::Timer buildTimer(stats, Stats::BUILD);
+        Huffman::buildCodeLengths(frequencies, options.maxCodeLength, sharedLengths);
+        settings.sharedLengths = sharedLengths;
+      }
+      File outputFile(options.archiveName.c_str());
+      std::ostream* out = outputFile.openWrite();
+      if(out == NULL) return false;
+      std::string head = BlockArchive::header(settings);
+      out->write(head.data(), head.length());
+      uint64_t offset = head.length();
+      std::vector<BlockArchive::Block> blocks;
+      std::vector<BlockArchive::Member> members;
+      std::vector<unsigned char> slots;
+      BlockArchive::EncodeState state;
+      uint64_t rawOffset = 0;
+      uint64_t namesLength = 0;
+      size_t used = 0;
+      //files fill the buffer one after the other, each full buffer is coded as a batch of blocks
+      for(const std::string& name : names){
+        Stats::Timer readTimer(stats, Stats::READ);
+        int fd = ::open(name.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+          std::cerr << "Error in read: '" << name << "' " << (fd < 0 ? strerror(errno) : "is no regular file") << std::endl;
+          if(fd >= 0) ::close(fd);
+          return false;
+        }
+        readTimer.stop();
+        BlockArchive::Member member;
+        bool dotDot = false;
+        member.name = Batch::memberName(name, dotDot);
+        member.rawOffset = rawOffset;
+        member.rawSize = st.st_size;
+        namesLength += member.name.length();
+        if(namesLength > UINT32_MAX){
+          std::cerr << "The member names exceed 4 GiB!" << std::endl;
+          ::close(fd);
+          return false;
+        }
+        for(uint64_t pos=0; pos<member.rawSize; ){
+          size_t size = std::min<uint64_t>(buffer.size() - used, member.rawSize - pos);
+          Stats::Timer pieceTimer(stats, Stats::READ);
+          bool read = Batch::readFile(fd, buffer.data() + used, size);
+          pieceTimer.stop();
+          if(!read){
+            std::cerr << "Error in read: '" << name << "' changed while it was read" << std::endl;
+            ::close(fd);
+            return false;
+          }
+          used += size;
+          pos += size;
+          if(used == buffer.size()){
+            BlockArchive::writeBatch(buffer.data(), used, *out, settings, pool, slots, state, blocks, offset);
+            if(!*out){
+              ::close(fd);
+              return false;
+            }
+            used = 0;
+          }
+        }
+        ::close(fd);
+        rawOffset += member.rawSize;
+        members.push_back(member);
+      }
+      if(used > 0) BlockArchive::writeBatch(buffer.data(), used, *out, settings, pool, slots, state, blocks, offset);
+      if(!*out) return false;
+      Stats::Timer serializeTimer(stats, Stats::SERIALIZE);
+      std::string directory = BlockArchive::directory(members);
+      serializeTimer.stop();
+      return BlockArchive::writeIndex(*out, blocks, offset, stats, directory);
+    }
+    //extracts the members named in options, all of them if none is, false on errors
+    static bool extract(const CLIOptions& options, const MappedFile& archive, ThreadPool& pool, Stats* stats){
+      Decoder decoder(&pool, stats);
+      if(!decoder.openBatch(Span<const unsigned char>(archive.getData(), archive.getLength()))){
+        std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+        return false;
+      }
+      std::vector<size_t> selected;
+      bool ok = true;
+      if(options.fileNames.empty()){
+        for(size_t i=0; i<decoder.memberCount(); i++) selected.push_back(i);
+      }
+      for(const std::string& name : options.fileNames){
+        size_t i;
+        if(decoder.findMember(name, i)){
+          selected.push_back(i);
+        }else{
+          std::cerr << "'" << name << "' is not in the archive!" << std::endl;
+          ok = false;
+        }
+      }
+      //the part of every member to extract, in the order of the data
+      std::vector<BlockArchive::Member> members(selected.size());
+      for(size_t k=0; k<selected.size(); k++){
+        BlockArchive::Member& m = members[k];
+        if(!decoder.memberAt(selected[k], m)){
+          std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+          return false;
+        }
+        if(options.list){
+          std::cout << std::setw(12) << m.rawSize << " " << m.name << "\n";
+          continue;
+        }
+        uint64_t offset = options.extractRange ? std::min(options.rangeOffset, m.rawSize) : 0;
+        m.rawSize = options.extractRange ? std::min(options.rangeLength, m.rawSize - offset) : m.rawSize;
+        m.rawOffset += offset;
+      }
+      if(options.list){
+        std::cout.flush();
+        return ok && (bool)std::cout;
+      }
+      if(!options.toStdout){
+        std::stable_sort(members.begin(), members.end(), [](const BlockArchive::Member& a, const BlockArchive::Member& b){ return a.rawOffset < b.rawOffset; });
+      }
+      //members next to each other are decoded together in runs of up to RUN_SIZE, so the blocks
+      //small members share are decoded once and on the pool
+      Arena arena;
+      std::vector<unsigned char> piece;
+      std::string lastDirectory;
+      for(size_t k=0; k<members.size(); ){
+        const BlockArchive::Member& first = members[k];
+        if(!options.toStdout && !Batch::safeName(first.name)){
+          std::cerr << "Skipping '" << first.name << "', it would be written outside of the current directory!" << std::endl;
+          ok = false;
+          k++;
+          continue;
+        }
+        //large members go through one reused buffer in pieces of RUN_SIZE, so memory does not grow
+        //with the member; pieces end at multiples of RUN_SIZE in the data, like the runs do
+        if(first.rawSize >= RUN_SIZE){
+          if(!decoder.openRange(first.rawOffset, first.rawSize)){
+            std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+            return false;
+          }
+          int fd = 1;
+          if(!options.toStdout){
+            Batch::makeParents(first.name, lastDirectory);
+            fd = ::open(first.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0){
+              std::cerr << "Error in write: '" << first.name << "' " << strerror(errno) << std::endl;
+              return false;
+            }
+          }
+          if(piece.empty()) piece.resize(RUN_SIZE);
+          for(uint64_t pos=0; pos<first.rawSize; ){
+            uint64_t next = std::min(first.rawSize, (first.rawOffset + pos) / RUN_SIZE * RUN_SIZE + RUN_SIZE - first.rawOffset);
+            Span<unsigned char> data(piece.data(), next - pos);
+            if(!decoder.decode(data, pos)){
+              std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+              if(fd != 1) ::close(fd);
+              return false;
+            }
+            Stats::Timer writeTimer(stats, Stats::WRITE);
+            bool written = true;
+            if(options.toStdout){
+              written = (bool)std::cout.write((const char*)data.data, data.size);
+            }else{
+              written = Batch::writeFile(fd, data.data, data.size);
+            }
+            if(!written){
+              if(options.toStdout) std::cerr << "Error in write: " << strerror(errno) << std::endl;
+              else std::cerr << "Error in write: '" << first.name << "' " << strerror(errno) << std::endl;
+              if(fd != 1) ::close(fd);
+              return false;
+            }
+            pos = next;
+            if(pos < first.rawSize) archive.release(decoder.archiveOffset(pos));
+          }
+          if(fd != 1) ::close(fd);
+          k++;
+          continue;
+        }
+        size_t end = k + 1;
+        uint64_t runEnd = first.rawOffset + first.rawSize;
+        while(end < members.size() && members[end].rawOffset == runEnd && members[end].rawSize < RUN_SIZE && runEnd + members[end].rawSize - first.rawOffset <= RUN_SIZE){
+          runEnd += members[end].rawSize;
+          end++;
+        }
+        Span<unsigned char> run = arena.allocate<unsigned char>(runEnd - first.rawOffset);
+        if(!decoder.openRange(first.rawOffset, run.size) || !decoder.decode(run)){
+          std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+          return false;
+        }
+        Stats::Timer writeTimer(stats, Stats::WRITE);
+        for(; k<end; k++){
+          const BlockArchive::Member& m = members[k];
+          const unsigned char* data = run.data + (m.rawOffset - first.rawOffset);
+          if(options.toStdout){
+            std::cout.write((const char*)data, m.rawSize);
+            continue;
+          }
+          if(!Batch::safeName(m.name)){
+            std::cerr << "Skipping '" << m.name << "', it would be written outside of the current directory!" << std::endl;
+            ok = false;
+            continue;
+          }
+          Batch::makeParents(m.name, lastDirectory);
+          int fd = ::open(m.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          if(fd < 0 || !Batch::writeFile(fd, data, m.rawSize)){
+            std::cerr << "Error in write: '" << m.name << "' " << strerror(errno) << std::endl;
+            if(fd >= 0) ::close(fd);
+            return false;
+          }
+          ::close(fd);
+        }
+        arena.reset();
+      }
+      std::cout.flush();
+      if(!std::cout){
+        std::cerr << "Error in write: " << strerror(errno) << std::endl;
+        return false;
+      }
+      return ok;
+    }
+};
+
+//codes the input into a version 4 stream as it arrives: whatever a read returns becomes one
+//frame, which is written and flushed at once, so a live producer's data is never held back
+static bool compressAdaptive(const CLIOptions& options, Stats* stats){
+    int fd = 0;
+    if(options.fileName != "-"){
+        fd = ::open(options.fileName.c_str(), O_RDONLY);
+        if(fd < 0){
+            std::cerr << "Error in read: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    File outputFile(options.archiveName.c_str());
+    std::ostream* out = outputFile.openWrite();
+    if(out == NULL) return false;
+    AdaptiveEncoder encoder(options.adaptiveModel, Adaptive::DEFAULT_INTERVAL_SHIFT, stats);
+    //not zero-filled, with FGK the bound is 16 times the input and mostly untouched
+    size_t bound = encoder.frameBound(Adaptive::MAX_FRAME_SIZE);
+    std::unique_ptr<unsigned char[]> input(new unsigned char[Adaptive::MAX_FRAME_SIZE]);
+    std::unique_ptr<unsigned char[]> frame(new unsigned char[bound]);
+    size_t length = encoder.header(frame.get());
+    out->write((const char*)frame.get(), length);
+    out->flush();
+    while(*out){
+        Stats::Timer readTimer(stats, Stats::READ);
+        ssize_t got = ::read(fd, input.get(), Adaptive::MAX_FRAME_SIZE);
+        readTimer.stop();
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0){
+            std::cerr << "Error in read: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if(got == 0) break;
+        length = encoder.encodeFrame(Span<const unsigned char>(input.get(), got), Span<unsigned char>(frame.get(), bound));
+        Stats::Timer writeTimer(stats, Stats::WRITE);
+        out->write((const char*)frame.get(), length);
+        out->flush();
+    }
+    if(fd != 0) ::close(fd);
+    length = encoder.end(frame.get());
+    out->write((const char*)frame.get(), length);
+    out->flush();
+    if(!*out){
+        std::cerr << "Error in write: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//output that keeps nothing, for decoding archives only to check them
+class NullOutput : public std::streambuf{
+  protected:
+    int_type overflow(int_type ch) override{
+      return traits_type::not_eof(ch);
+    }
+    std::streamsize xsputn(const char*, std::streamsize count) override{
+      return count;
+    }
 };
 
+//decodes a whole archive without writing it anywhere, false if it is corrupted
+//block archives in regular files are decoded a block per thread and checked against their
+//checksums, anything else is decoded as a stream into NullOutput
+static bool verifyArchive(const CLIOptions& options, MappedFile& mappedArchive, bool mapped, Stats* stats){
+    ThreadPool pool(options.threads);
+    if(mapped && BlockArchive::isArchive(mappedArchive.getData(), mappedArchive.getLength())){
+        Span<const unsigned char> archive(mappedArchive.getData(), mappedArchive.getLength());
+        Decoder decoder(&pool, stats);
+        if(!decoder.open(archive) || !decoder.verify()) return false;
+        if(!Batch::isBatch(archive.data, archive.size)) return true;
+        //every member has to lie within the data
+        Decoder directory;
+        BlockArchive::Member m;
+        if(!directory.openBatch(archive)) return false;
+        for(size_t i=0; i<directory.memberCount(); i++){
+            if(!directory.memberAt(i, m) || m.rawOffset + m.rawSize > decoder.rawSize()) return false;
+        }
+        return true;
+    }
+    mappedArchive.close();
+    File inputFile(options.archiveName.c_str());
+    std::istream* in = inputFile.openRead();
+    if(in == NULL) exit(1);
+    NullOutput discard;
+    std::ostream out(&discard);
+    std::string prefix(3, '\0');
+    in->read(&prefix[0], 3);
+    prefix.resize(in->gcount());
+    if(BlockArchive::isArchive((const unsigned char*)prefix.data(), prefix.length())){
+        return BlockArchive::decompressStream(*in, out, pool, prefix, stats);
+    }
+    if(Adaptive::isStream((const unsigned char*)prefix.data(), prefix.length())){
+        AdaptiveDecoder decoder(stats);
+        return decoder.decompress(*in, out, prefix);
+    }
+    Stats::Timer readTimer(stats, Stats::READ);
+    std::string inputString;
+    inputString.swap(prefix);
+    inputString.append(std::istreambuf_iterator<char>(*in), {});
+    readTimer.stop();
+    Stats::Timer codeTimer(stats, Stats::CODE);
+    std::string outString;
+    uint64_t codedBits = 0;
+    return Huffman::decodeSerialized((const unsigned char*)inputString.data(), inputString.length(), outString, codedBits);
+}
+
+//writes the output of a single stream archive, exits on errors
+static void decodedLegacy(const CLIOptions& options, Stats* stats, File& outputFile, const std::string& outString, uint64_t archiveBytes, uint64_t codedBits, bool ok){
+    if(!ok && codedBits == 0){
+        std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+        exit(1);
+    }
+    if(!ok) std::cerr << "Symbol not matched! stringPos=" << outString.length() << std::endl;
+    Stats::Timer writeTimer(stats, Stats::WRITE);
+    if(!outputFile.write(outString)) exit(1);
+    writeTimer.stop();
+    if(stats){
+        stats->archiveBytes += archiveBytes;
+        stats->rawBytes += outString.length();
+        stats->symbols += outString.length();
+        stats->codedBits += codedBits;
+        stats->blocks++;
+    }
+}
+
 int main(int argc, char** argv){
     CLIOptions options;
     options.parseArgs(argc, argv);
     if(options.extract && options.archiveName.length() == 0){
         CLIOptions::printHelpAndExit(argc, argv);
     }
-    if(options.extract && options.fileName.length() != 0){
+    if(!options.extract && !options.batch && options.fileNames.size() != 1){
         CLIOptions::printHelpAndExit(argc, argv);
     }
-    if(!options.extract && options.fileName.length() == 0){
+    if(options.batch && !options.extract && options.archiveName.length() == 0){
         CLIOptions::printHelpAndExit(argc, argv);
     }
+    if(options.adaptive && options.batch){
+        std::cerr << "Batch archives are coded in blocks, not adaptively!" << std::endl;
+        exit(1);
+    }
     if(!options.extract && options.archiveName.length() == 0){
-        options.archiveName = options.fileName + std::string(".whz");
+        options.archiveName = (options.fileName == "-" ? "-" : options.fileName + std::string(".whz"));
     }
-    
+    std::ios::sync_with_stdio(false);
+    AsyncIO::select(options.io);
+    //the codec stays quiet, with --stats a summary goes to stderr once the output is complete
+    Stats statsStorage;
+    Stats* stats = options.stats ? &statsStorage : NULL;
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    auto finish = [&](){
+        if(stats){
+            double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+            if(options.statsJson){
+                stats->printJson(std::cerr, options.extract, wallSeconds);
+            }else{
+                stats->print(std::cerr, options.extract, wallSeconds);
+            }
+        }
+        exit(0);
+    };
+
     if(options.extract){
-        std::cout << "Going to extract archive '" << options.archiveName << "'!" << std::endl;
-        //read file
-        File inputFile(options.archiveName.c_str());
-        std::string inputString = inputFile.read();
-        std::cout << "DEBUG, inputString length = " << inputString.length() << std::endl;
-        //decompress
-        std::pair<BitStream,std::map<BitSymbol,char>> dataPair = Huffman::deserialize(inputString);
-        std::string outString = Huffman::strDecode(dataPair.first, dataPair.second);
-        //write file
         std::string outputFileName = options.archiveName;
-        if(outputFileName.length() > 4 && outputFileName.substr(outputFileName.length()-4, 4) == ".whz"){
+        if(options.toStdout || outputFileName == "-"){
+            outputFileName = "-";
+        }else if(outputFileName.length() > 4 && outputFileName.substr(outputFileName.length()-4, 4) == ".whz"){
             outputFileName = outputFileName.substr(0, outputFileName.length()-4);
         }else{
             outputFileName += ".dec";
         }
-        std::cout << "Writing into file '" << outputFileName << "'!" << std::endl;
+        //block archive between regular files: decode from the mapped archive straight into the mapped output
+        MappedFile mappedArchive;
+        Stats::Timer readTimer(stats, Stats::READ);
+        bool mapped = options.archiveName != "-" && mappedArchive.openRead(options.archiveName.c_str(), !options.extractRange && options.fileNames.empty());
+        readTimer.stop();
+        if(options.verify){
+            if(options.extractRange || !options.fileNames.empty()){
+                std::cerr << "Verifying checks the whole archive, without a range or members!" << std::endl;
+                exit(1);
+            }
+            if(!verifyArchive(options, mappedArchive, mapped, stats)){
+                std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+                exit(1);
+            }
+            finish();
+        }
+        if(mapped && Batch::isBatch(mappedArchive.getData(), mappedArchive.getLength())){
+            ThreadPool pool(options.threads);
+            if(!Batch::extract(options, mappedArchive, pool, stats)) exit(1);
+            finish();
+        }
+        if(options.list || !options.fileNames.empty()){
+            std::cerr << (options.list ? "Listing" : "Extracting members") << " needs a batch archive in a regular file!" << std::endl;
+            exit(1);
+        }
+        if(mapped && outputFileName != "-" && BlockArchive::isArchive(mappedArchive.getData(), mappedArchive.getLength())){
+            ThreadPool pool(options.threads);
+            Decoder decoder(&pool, stats);
+            if(!decoder.open(Span<const unsigned char>(mappedArchive.getData(), mappedArchive.getLength()))){
+                std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+                exit(1);
+            }
+            uint64_t rawSize = decoder.rawSize();
+            uint64_t offset = options.extractRange ? std::min(options.rangeOffset, rawSize) : 0;
+            uint64_t length = options.extractRange ? std::min(options.rangeLength, rawSize - offset) : rawSize;
+            MappedFile mappedOutput;
+            if(!mappedOutput.createWrite(outputFileName.c_str(), length)){
+                std::cerr << "Error in write: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            if(!decoder.decode(Span<unsigned char>(mappedOutput.getData(), length), offset)){
+                std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+                exit(1);
+            }
+            Stats::Timer writeTimer(stats, Stats::WRITE);
+            mappedOutput.close();
+            writeTimer.stop();
+            finish();
+        }
         File outputFile(outputFileName.c_str());
-        outputFile.write(outString);
-        exit(0);
+        //single stream archives are decoded in memory, from one input into one output buffer
+        std::string outString;
+        uint64_t codedBits = 0;
+        if(mapped && !options.extractRange && !BlockArchive::isArchive(mappedArchive.getData(), mappedArchive.getLength()) && !Adaptive::isStream(mappedArchive.getData(), mappedArchive.getLength())){
+            Stats::Timer codeTimer(stats, Stats::CODE);
+            bool ok = Huffman::decodeSerialized(mappedArchive.getData(), mappedArchive.getLength(), outString, codedBits);
+            codeTimer.stop();
+            decodedLegacy(options, stats, outputFile, outString, mappedArchive.getLength(), codedBits, ok);
+            finish();
+        }
+        mappedArchive.close();
+        File inputFile(options.archiveName.c_str());
+        //a range is read with seeks, anything else front to back
+        std::istream* in = inputFile.openRead(!options.extractRange);
+        if(in == NULL) exit(1);
+        //the version decides between streaming block archives and single streams
+        std::string prefix(3, '\0');
+        in->read(&prefix[0], 3);
+        prefix.resize(in->gcount());
+        if(BlockArchive::isArchive((const unsigned char*)prefix.data(), prefix.length())){
+            ThreadPool pool(options.threads);
+            std::ostream* out = outputFile.openWrite();
+            if(out == NULL) exit(1);
+            bool ok;
+            if(options.extractRange){
+                if(inputFile.isStandardStream()){
+                    std::cerr << "Range extraction needs a seekable archive!" << std::endl;
+                    exit(1);
+                }
+                ok = BlockArchive::extractRange(*in, options.rangeOffset, options.rangeLength, *out, pool, stats);
+            }else{
+                ok = BlockArchive::decompressStream(*in, *out, pool, prefix, stats);
+            }
+            //the decoders stop at a failed output too, which is no fault of the archive
+            if(!*out){
+                std::cerr << "Error in write: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            if(!ok){
+                std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+                exit(1);
+            }
+            finish();
+        }
+        if(options.extractRange){
+            std::cerr << "Range extraction needs a block archive!" << std::endl;
+            exit(1);
+        }
+        if(Adaptive::isStream((const unsigned char*)prefix.data(), prefix.length())){
+            std::ostream* out = outputFile.openWrite();
+            if(out == NULL) exit(1);
+            AdaptiveDecoder decoder(stats);
+            bool ok = decoder.decompress(*in, *out, prefix);
+            if(!*out){
+                std::cerr << "Error in write: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            if(!ok){
+                std::cerr << "Archive '" << options.archiveName << "' is corrupted!" << std::endl;
+                exit(1);
+            }
+            finish();
+        }
+        Stats::Timer legacyReadTimer(stats, Stats::READ);
+        std::string inputString;
+        inputString.swap(prefix);
+        inputString.append(std::istreambuf_iterator<char>(*in), {});
+        legacyReadTimer.stop();
+        Stats::Timer codeTimer(stats, Stats::CODE);
+        bool ok = Huffman::decodeSerialized((const unsigned char*)inputString.data(), inputString.length(), outString, codedBits);
+        codeTimer.stop();
+        decodedLegacy(options, stats, outputFile, outString, inputString.length(), codedBits, ok);
+        finish();
+    }else if(options.adaptive){
+        if(!compressAdaptive(options, stats)) exit(1);
+        finish();
+    }else if(options.batch){
+        ThreadPool pool(options.threads);
+        if(!Batch::compress(options, pool, stats)) exit(1);
+        finish();
     }else{
-        std::cout << "Going to create archive '" << options.archiveName << "' from file '" << options.fileName << "'!" << std::endl;
-        //read file
+        uint32_t blockSize = options.blockSize ? options.blockSize : BlockArchive::DEFAULT_BLOCK_SIZE;
+        ThreadPool pool(options.threads);
         File inputFile(options.fileName.c_str());
-        std::string inputString = inputFile.read();
-        //compress
-        std::pair<BitStream,std::map<BitSymbol,char>> out = Huffman::strEncode(inputString);
-        std::string outString = Huffman::serialize(out.first, out.second);
-        //write file
+        //regular files are coded straight from their mapped pages, anything else is streamed
+        MappedFile mappedInput;
+        Stats::Timer readTimer(stats, Stats::READ);
+        bool mapped = !inputFile.isStandardStream() && mappedInput.openRead(options.fileName.c_str());
+        readTimer.stop();
+        std::istream* in = NULL;
+        if(!mapped){
+            in = inputFile.openRead();
+            if(in == NULL) exit(1);
+        }
+        //a shared table needs a first pass over the whole input
+        unsigned char sharedLengths[256] = {0};
+        bool sharedTable = options.sharedTable;
+        if(sharedTable && !mapped && !inputFile.isSeekable()){
+            std::cerr << "A shared table needs a seekable input, using a table per block!" << std::endl;
+            sharedTable = false;
+        }
+        if(sharedTable && options.transform != BlockArchive::TRANSFORM_NONE){
+            std::cerr << "A shared table is counted on untransformed bytes, using a table per block!" << std::endl;
+            sharedTable = false;
+        }
+        if(sharedTable){
+            Stats::Timer histogramTimer(stats, Stats::HISTOGRAM);
+            uint64_t frequencies[256] = {0};
+            if(mapped){
+                BlockArchive::histogram(mappedInput.getData(), mappedInput.getLength(), blockSize, options.sampleStride, frequencies, pool);
+            }else{
+                BlockArchive::histogram(*in, blockSize, options.sampleStride, frequencies, pool);
+                in->clear();
+                if(!in->seekg(0)){
+                    std::cerr << "Error in read: " << strerror(errno) << std::endl;
+                    exit(1);
+                }
+            }
+            histogramTimer.stop();
+            Stats::Timer buildTimer(stats, Stats::BUILD);
+            Huffman::buildCodeLengths(frequencies, options.maxCodeLength, sharedLengths);
+        }
+        BlockArchive::Settings settings;
+        settings.blockSize = blockSize;
+        settings.maxCodeLength = options.maxCodeLength;
+        settings.sharedLengths = sharedTable ? sharedLengths : NULL;
+        settings.streams = options.streams;
+        settings.contextTables = options.contextTables;
+        settings.transform = options.transform;
+        settings.stats = stats;
+        //mapped input to a regular file: the archive is coded straight into the mapped output,
+        //which is cut down to the archive's length at the end
+        if(mapped && options.archiveName != "-"){
+            Encoder encoder(settings, &pool);
+            size_t bound = encoder.bound(mappedInput.getLength());
+            MappedFile mappedOutput;
+            if(mappedOutput.createWrite(options.archiveName.c_str(), bound)){
+                size_t length = encoder.encode(Span<const unsigned char>(mappedInput.getData(), mappedInput.getLength()), Span<unsigned char>(mappedOutput.getData(), bound));
+                Stats::Timer writeTimer(stats, Stats::WRITE);
+                if(length == 0 || !mappedOutput.close(length)){
+                    std::cerr << "Error in write: " << strerror(errno) << std::endl;
+                    exit(1);
+                }
+                writeTimer.stop();
+                finish();
+            }
+            //no room for the bound, the archive itself may still fit: it is streamed below, which
+            //also reports any other error
+        }
         File outputFile(options.archiveName.c_str());
-        outputFile.write(outString);
-        exit(0);
+        std::ostream* out = outputFile.openWrite();
+        if(out == NULL) exit(1);
+        bool ok;
+        if(mapped){
+            ok = BlockArchive::compressBuffer(mappedInput.getData(), mappedInput.getLength(), *out, settings, pool);
+        }else{
+            ok = BlockArchive::compressStream(*in, *out, settings, pool);
+        }
+        if(!ok){
+            std::cerr << "Error in write: " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        out->flush();
+        finish();
     }
     
     return 0;
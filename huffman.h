@@ -0,0 +1,3922 @@
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <iostream>
+#include <iomanip>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HUFFMAN_X86_KERNELS 1 //BMI2 and AVX2 variants of the coding loops, see Kernels
+#endif
+
+inline bool comparePair(const std::pair<char,uint64_t>& o1, const std::pair<char,uint64_t>& o2){
+  if(o1.second != o2.second) return (o1.second > o2.second);
+  return (unsigned char)o1.first < (unsigned char)o2.first; //deterministic order of ties
+}
+
+//instruction set the coding loops run with, checked at runtime so one binary runs on any x86-64
+//BMI2 turns the variable shifts of the bit readers and writers into single flag-free instructions,
+//AVX2 decodes 4 or 8 interleaved streams in vector lanes with gathered table lookups
+//every level writes and reads exactly the same bits as the portable scalar code
+//AVX2 has to be selected: each round of lanes waits for a gather, which came out slower than
+//the BMI2 loops advancing the streams independently
+class Kernels{
+  public:
+    enum Level{SCALAR, BMI2, AVX2};
+  private:
+    static std::atomic<int>& selected(){
+      static std::atomic<int> level{BMI2};
+      return level;
+    }
+    static Level detect(){
+#ifdef HUFFMAN_X86_KERNELS
+      __builtin_cpu_init();
+      if(!__builtin_cpu_supports("bmi2")) return SCALAR;
+      return __builtin_cpu_supports("avx2") ? AVX2 : BMI2;
+#else
+      return SCALAR;
+#endif
+    }
+  public:
+    //what the CPU supports
+    static Level supported(){
+      static const Level level = detect();
+      return level;
+    }
+    //what coding uses: the selected level as far as the CPU supports it
+    static Level active(){
+      int level = selected();
+      return supported() < level ? supported() : Level(level);
+    }
+    //selects the level of all coding from now on, e.g. SCALAR to compare against the portable code
+    static void select(Level level){
+      selected() = level;
+    }
+    static const char* name(Level level){
+      static const char* names[] = {"scalar", "bmi2", "avx2"};
+      return names[level];
+    }
+    static bool parse(const char* name, Level& level){
+      for(int l=SCALAR; l<=AVX2; l++){
+        if(strcmp(name, Kernels::name(Level(l))) == 0){
+          level = Level(l);
+          return true;
+        }
+      }
+      return false;
+    }
+};
+
+//CRC-32C (the Castagnoli polynomial of iSCSI, ext4 and SSE4.2), which block archives keep for
+//every block; the SSE4.2 crc32 instruction takes 8 bytes per step where the CPU has it, elsewhere
+//eight tables do (slicing-by-8), for the same result
+//one crc32 has to wait for the one before, so three lanes of LANE bytes run side by side and are
+//joined after: the CRC register goes through zero bytes linearly, so moving it past a lane is
+//the XOR of what each of its bits turns into
+class Crc32c{
+  private:
+    static const uint32_t POLYNOMIAL = 0x82F63B78; //reflected
+    static const size_t LANE = 8192;
+    static std::atomic<bool>& selected(){
+      static std::atomic<bool> instruction{true};
+      return instruction;
+    }
+    struct Tables{
+      uint32_t t[8][256];
+      uint32_t lane[32]; //register bit b after LANE zero bytes
+      Tables(){
+        for(uint32_t i=0; i<256; i++){
+          uint32_t crc = i;
+          for(int k=0; k<8; k++) crc = (crc >> 1) ^ (POLYNOMIAL & (0u - (crc & 1)));
+          t[0][i] = crc;
+        }
+        //t[k] advances a byte by k more zero bytes
+        for(int k=1; k<8; k++){
+          for(uint32_t i=0; i<256; i++) t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+        }
+        for(int b=0; b<32; b++){
+          uint32_t crc = uint32_t(1) << b;
+          for(size_t i=0; i<LANE; i++) crc = (crc >> 8) ^ t[0][crc & 0xFF];
+          lane[b] = crc;
+        }
+      }
+    };
+    static const Tables& tables(){
+      static const Tables tables;
+      return tables;
+    }
+    static uint32_t updateScalar(uint32_t crc, const unsigned char* data, size_t length){
+      const uint32_t (*t)[256] = Crc32c::tables().t;
+      while(length >= 8){
+        uint32_t low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24));
+        uint32_t high = data[4] | (data[5] << 8) | (data[6] << 16) | (uint32_t(data[7]) << 24);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+            ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        length -= 8;
+      }
+      while(length-- > 0) crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+      return crc;
+    }
+    //the register after LANE more zero bytes
+    static uint32_t skipLane(uint32_t crc){
+      const uint32_t* lane = Crc32c::tables().lane;
+      uint32_t skipped = 0;
+      for(int b=0; b<32; b++) skipped ^= lane[b] & (0u - ((crc >> b) & 1));
+      return skipped;
+    }
+#ifdef HUFFMAN_X86_KERNELS
+    __attribute__((target("sse4.2"))) static uint32_t updateSse42(uint32_t crc, const unsigned char* data, size_t length){
+      while(length >= 3*LANE){
+        uint64_t a = crc, b = 0, c = 0;
+        for(size_t i=0; i<LANE; i+=8){
+          uint64_t words[3];
+          memcpy(&words[0], data + i, 8);
+          memcpy(&words[1], data + LANE + i, 8);
+          memcpy(&words[2], data + 2*LANE + i, 8);
+          a = _mm_crc32_u64(a, words[0]);
+          b = _mm_crc32_u64(b, words[1]);
+          c = _mm_crc32_u64(c, words[2]);
+        }
+        crc = Crc32c::skipLane(Crc32c::skipLane(uint32_t(a)) ^ uint32_t(b)) ^ uint32_t(c);
+        data += 3*LANE;
+        length -= 3*LANE;
+      }
+      uint64_t wide = crc;
+      while(length >= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        length -= 8;
+      }
+      crc = uint32_t(wide);
+      while(length-- > 0) crc = _mm_crc32_u8(crc, *data++);
+      return crc;
+    }
+#endif
+  public:
+    //whether the CPU has the crc32 instruction
+    static bool hardware(){
+#ifdef HUFFMAN_X86_KERNELS
+      static const bool sse42 = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+      return sse42;
+#else
+      return false;
+#endif
+    }
+    //what compute uses: the instruction unless the tables are selected, as far as the CPU has it
+    static bool active(){
+      return selected() && Crc32c::hardware();
+    }
+    //false computes every CRC with the tables from now on, e.g. to measure them
+    static void select(bool instruction){
+      selected() = instruction;
+    }
+    //CRC-32C of data following crc, the CRC of the bytes before (0 for none)
+    static uint32_t compute(const unsigned char* data, size_t length, uint32_t crc = 0){
+#ifdef HUFFMAN_X86_KERNELS
+      if(Crc32c::active()) return ~Crc32c::updateSse42(~crc, data, length);
+#endif
+      return ~Crc32c::updateScalar(~crc, data, length);
+    }
+};
+
+
+class BitSymbol{
+  private:
+    unsigned char length = 0;
+    uint64_t data = 0;
+    unsigned char iteratorPtr = 0;
+  public:
+    void add(bool bit){
+      data |= (bit ? (uint64_t(1) << (63-length) ) : 0);
+      length++;
+    }
+    //appends the lowest n bits of bits, most significant first
+    void addBits(uint64_t bits, unsigned char n){
+      if(n == 0) return;
+      bits &= (n < 64 ? (uint64_t(1) << n) - 1 : ~uint64_t(0));
+      data |= (bits << (64-n)) >> length;
+      length += n;
+    }
+    //the code right-aligned, e.g. "101" -> 0b101
+    uint64_t getBits() const {
+      if(length == 0) return 0;
+      return data >> (64-length);
+    }
+    void resetIterator(){
+      iteratorPtr = 0;
+    }
+    bool hasNext(){
+      return iteratorPtr < length;
+    }
+    bool getNext(){
+      return data & (uint64_t(1) << (63 - (iteratorPtr++) ));
+    }
+    std::string getAsString() const {
+      std::string ret;
+      for(unsigned char i=0; i<length; i++){
+        ret += (data & (uint64_t(1) << (63 - i)) ? "1" : "0");
+      }
+      return ret;
+    }
+    unsigned char getLength() const {
+      return length;
+    }
+    //compares the first n bits (n <= 64)
+    bool equalsN(const BitSymbol &other, unsigned char n){
+      uint64_t mask = (n == 0 ? 0 : ~uint64_t(0) << (64 - n));
+      return (this->data & mask) == (other.data & mask);
+    }
+    bool operator==(const BitSymbol o2) const {
+      return (this->data == o2.data && this->length == o2.length);
+    }
+    bool operator<(const BitSymbol o2) const {
+      return this->data < o2.data;
+    }
+    bool getLSB(){
+      if(length==0) return false;
+      return data & (uint64_t(1) << (64-length) );
+    }
+};
+
+class BitStream{
+  private:
+    std::vector<unsigned char> bytes;
+    unsigned char tmp = 0;
+    char ptr = 0;
+    unsigned char padding = 0; //bits appended by finalize, not part of the data
+  public:
+    static BitStream createFromString(const std::string& str, unsigned int startIndex=0){
+      if(startIndex >= str.length()) return BitStream();
+      return BitStream::createFromBytes((const unsigned char*)str.data() + startIndex, str.length() - startIndex);
+    }
+    //copies count whole bytes in one go
+    static BitStream createFromBytes(const unsigned char* data, size_t count){
+      BitStream bs;
+      bs.bytes.assign(data, data + count);
+      return bs;
+    }
+    void add(bool symbol){
+      tmp |= (symbol ? (0x01 << (7-ptr) ) : 0);
+      ptr++;
+      if(ptr > 7){
+        ptr = 0;
+        bytes.push_back(tmp);
+        tmp = 0;
+      }
+    }
+    //appends the lowest count bits of bits, most significant first
+    void addBits(uint64_t bits, unsigned char count){
+      while(count > 0){
+        unsigned char take = std::min<unsigned char>(count, 8 - ptr);
+        count -= take;
+        tmp |= ((bits >> count) & ((1u << take) - 1)) << (8 - ptr - take);
+        ptr += take;
+        if(ptr > 7){
+          ptr = 0;
+          bytes.push_back(tmp);
+          tmp = 0;
+        }
+      }
+    }
+    void add(const BitSymbol& symbol){
+      this->addBits(symbol.getBits(), symbol.getLength());
+    }
+    void addByte(unsigned char add){
+      this->bytes.push_back(add);
+    }
+    void addBytes(const unsigned char* data, size_t count){
+      if(ptr == 0){
+        this->bytes.insert(this->bytes.end(), data, data + count);
+        return;
+      }
+      for(size_t i=0; i<count; i++) this->addBits(data[i], 8);
+    }
+    //takes over already packed bytes, e.g. the output of a BitWriter
+    //bitLength is the number of data bits, the rest of the last byte is padding
+    static BitStream createFromBytes(std::vector<unsigned char>&& bytes, uint64_t bitLength){
+      BitStream bs;
+      bs.bytes = std::move(bytes);
+      bs.padding = bs.bytes.size()*8 - bitLength;
+      return bs;
+    }
+    void finalize(){
+      while(ptr > 0){
+        this->add(1);
+        padding++;
+      }
+    }
+    unsigned char getPaddingBits() const {
+      return padding;
+    }
+    //bits added since the last complete byte, finalize pads them with ones to a byte
+    unsigned char getPendingBits() const {
+      return ptr;
+    }
+    unsigned char getPendingByte() const {
+      return tmp | (0xFF >> ptr);
+    }
+    void setPaddingBits(unsigned char bits){
+      padding = bits;
+    }
+    std::vector<unsigned char> &getData(){
+      return this->bytes;
+    }
+    const std::vector<unsigned char> &getData() const {
+      return this->bytes;
+    }
+    std::string getAsString(){
+      std::string ret;
+      for(unsigned char b : this->bytes) ret += b;
+      return ret;
+    }
+    //number of data bits, without the padding
+    unsigned int getLength() const {
+      return bytes.size()*8 + ptr - padding;
+    }
+    //length bits (at most 64) from bit start on, fewer where the complete bytes end
+    BitSymbol getSubBits(unsigned int start, unsigned int length) const {
+      uint64_t available = (uint64_t(bytes.size())*8 > start ? uint64_t(bytes.size())*8 - start : 0);
+      if(length > available) length = available;
+      BitSymbol bs;
+      if(length == 0) return bs;
+      //the up to 9 bytes covering the bits, shifted to the MSB
+      size_t first = start/8;
+      unsigned int shift = start%8;
+      uint64_t word = 0;
+      for(size_t i=0; i<8 && first + i < bytes.size(); i++) word |= uint64_t(bytes[first + i]) << (56 - 8*i);
+      word <<= shift;
+      if(shift > 0 && first + 8 < bytes.size()) word |= bytes[first + 8] >> (8 - shift);
+      bs.addBits(word >> (64 - length), length);
+      return bs;
+    }
+    bool getSubBit(unsigned int index){
+      unsigned int byteNum = index/8;
+      unsigned int bitNum = index%8;
+      if(byteNum >= this->bytes.size()) return false;
+      return this->bytes[byteNum] & ( 0x01 << (7-bitNum) );
+    }
+};
+
+//reads bits MSB-first through a 64-bit buffer, refilled a whole word at a time
+class BitReader{
+  private:
+    const unsigned char* begin;
+    const unsigned char* ptr;
+    const unsigned char* end;
+    uint64_t buffer = 0; //valid bits are aligned to the MSB
+    unsigned int bitCount = 0; //number of valid bits in buffer
+    static uint64_t loadBigEndian(const unsigned char* p){
+      uint64_t word;
+      memcpy(&word, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      word = __builtin_bswap64(word);
+#endif
+      return word;
+    }
+  public:
+    BitReader(){
+      this->begin = this->ptr = this->end = NULL;
+    }
+    BitReader(const unsigned char* data, size_t size){
+      this->begin = data;
+      this->ptr = data;
+      this->end = data + size;
+    }
+    //after refill at least 56 bits are valid unless the input is exhausted
+    void refill(){
+      if(end - ptr >= 8){
+        buffer |= loadBigEndian(ptr) >> bitCount;
+        ptr += (63 - bitCount) >> 3;
+        bitCount |= 56;
+      }else{
+        while(bitCount <= 56 && ptr < end){
+          buffer |= uint64_t(*ptr++) << (56 - bitCount);
+          bitCount += 8;
+        }
+      }
+    }
+    //bits past the end of the input read as zeros
+    uint64_t peek() const {
+      return buffer;
+    }
+    void consume(unsigned int n){
+      buffer <<= n;
+      bitCount -= n;
+    }
+    uint64_t position() const {
+      return uint64_t(ptr - begin)*8 - bitCount;
+    }
+    //n bits (0 < n <= 64) starting at bit pos, right-aligned, without touching the buffer
+    uint64_t readBitsAt(uint64_t pos, unsigned int n) const {
+      uint64_t v = 0;
+      for(unsigned int i=0; i<n; i++, pos++){
+        size_t byteNum = pos/8;
+        bool bit = (begin + byteNum < end) && (begin[byteNum] & (0x80 >> (pos%8)));
+        v = (v << 1) | (bit ? 1 : 0);
+      }
+      return v;
+    }
+    void seek(uint64_t bitPos){
+      ptr = begin + bitPos/8;
+      if(ptr > end) ptr = end;
+      buffer = 0;
+      bitCount = 0;
+      refill();
+      consume(bitPos%8);
+    }
+};
+
+//packs codes MSB-first into a 64-bit accumulator and stores whole words
+//into a caller-sized buffer, which needs 8 bytes of slack past the data
+class BitWriter{
+  private:
+    unsigned char* begin;
+    unsigned char* ptr;
+    uint64_t buffer = 0; //pending bits are aligned to the MSB
+    unsigned int bitCount = 0;
+    static void storeBigEndian(unsigned char* p, uint64_t word){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      word = __builtin_bswap64(word);
+#endif
+      memcpy(p, &word, 8);
+    }
+    void flush(){
+      storeBigEndian(ptr, buffer);
+      unsigned int fullBytes = bitCount >> 3;
+      ptr += fullBytes;
+      buffer = (fullBytes == 8 ? 0 : buffer << (fullBytes*8));
+      bitCount &= 7;
+    }
+  public:
+    BitWriter(unsigned char* dst){
+      this->begin = dst;
+      this->ptr = dst;
+    }
+    //code holds length bits right-aligned, 0 < length <= 64
+    void put(uint64_t code, unsigned int length){
+      if(length > 32){
+        this->put(code >> 32, length - 32);
+        code &= 0xFFFFFFFF;
+        length = 32;
+      }
+      if(bitCount + length > 64) flush();
+      buffer |= code << (64 - bitCount - length);
+      bitCount += length;
+    }
+    //pads the last byte with ones like BitStream::finalize, returns bytes written
+    size_t finish(){
+      unsigned int pad = (8 - (bitCount & 7)) & 7;
+      if(pad > 0) this->put((1u << pad) - 1, pad);
+      flush();
+      return ptr - begin;
+    }
+};
+
+//flat code table indexed by byte value
+class EncodeTable{
+  private:
+    uint64_t codes[256] = {0}; //right-aligned code bits
+    unsigned char lengths[256] = {0};
+  public:
+    EncodeTable(){}
+    EncodeTable(const std::map<BitSymbol,char>& symbolSubstMap){
+      for(const auto& p : symbolSubstMap){
+        unsigned char c = p.second;
+        codes[c] = p.first.getBits();
+        lengths[c] = p.first.getLength();
+      }
+    }
+    //canonical codes for the given lengths (0 = unused symbol): shorter codes first,
+    //codes of the same length ordered by symbol value
+    EncodeTable(const unsigned char codeLengths[256]){
+      const unsigned int maxLength = 64;
+      uint64_t count[maxLength + 1] = {0};
+      for(int c=0; c<256; c++) count[codeLengths[c]]++;
+      count[0] = 0;
+      uint64_t next[maxLength + 1] = {0};
+      uint64_t code = 0;
+      for(unsigned int length=1; length<=maxLength; length++){
+        code = (code + count[length - 1]) << 1;
+        next[length] = code;
+      }
+      for(int c=0; c<256; c++){
+        if(codeLengths[c] == 0 || codeLengths[c] > maxLength) continue;
+        lengths[c] = codeLengths[c];
+        codes[c] = next[codeLengths[c]]++;
+      }
+    }
+    bool contains(unsigned char c) const {
+      return lengths[c] != 0;
+    }
+    uint64_t code(unsigned char c) const {
+      return codes[c];
+    }
+    unsigned char length(unsigned char c) const {
+      return lengths[c];
+    }
+    //size of the encoded bits for the given symbol frequencies
+    uint64_t encodedBits(const uint64_t frequencies[256]) const {
+      uint64_t bits = 0;
+      for(int i=0; i<256; i++) bits += frequencies[i] * lengths[i];
+      return bits;
+    }
+    //encodes every stride-th of count bytes starting with the first one
+    void encodeStrided(const unsigned char* data, size_t count, size_t stride, BitWriter& writer) const {
+#ifdef HUFFMAN_X86_KERNELS
+      if(Kernels::active() >= Kernels::BMI2) return this->encodeBmi2(data, count, stride, writer);
+#endif
+      this->encodeScalar(data, count, stride, writer);
+    }
+    //encodes count bytes, the writer must have room for all of them
+    void encode(const unsigned char* data, size_t count, BitWriter& writer) const {
+      this->encodeStrided(data, count, 1, writer);
+    }
+  private:
+    void encodeScalar(const unsigned char* data, size_t count, size_t stride, BitWriter& writer) const {
+      for(size_t i=0; i<count; i+=stride){
+        unsigned char c = data[i];
+        writer.put(codes[c], lengths[c]);
+      }
+    }
+#ifdef HUFFMAN_X86_KERNELS
+    //the same loop with the writer inlined and compiled for BMI2
+    __attribute__((target("bmi2"), flatten)) void encodeBmi2(const unsigned char* data, size_t count, size_t stride, BitWriter& writer) const {
+      this->encodeScalar(data, count, stride, writer);
+    }
+#endif
+};
+
+//two-level lookup table decoder built from a substitution map or canonical code lengths
+//the primary table resolves up to two short symbols per lookup, longer codes
+//go through a second-level table and only very long ones fall back to a scan
+class DecodeTable{
+  public:
+    static const unsigned int PRIMARY_BITS = 11; //lookup width of tables without pairs (context tables)
+    static const unsigned int MAX_PRIMARY_BITS = 12;
+    static const unsigned int MAX_SECONDARY_BITS = 12;
+  private:
+    static const uint32_t LINK_NONE = 0xFFFFFFFF;
+    //the AVX2 decoder reads entries as little endian words: symbols[0] in bits 32-39,
+    //count in bits 48-55 and length in bits 56-63
+    struct Entry{
+      uint32_t link = LINK_NONE; //offset of the second-level table
+      unsigned char symbols[2] = {0, 0};
+      unsigned char count = 0; //resolved symbols, 0 means link or invalid code
+      unsigned char length = 0; //bits consumed, for links the second-level width
+    };
+    static_assert(sizeof(Entry) == 8, "entries are gathered as 64-bit words");
+    std::vector<Entry> single; //one symbol per entry
+    std::vector<Entry> multi; //as single, but packs a second symbol when it fits
+    std::vector<Entry> secondary;
+    std::vector<std::pair<BitSymbol,char>> longSymbols; //longer than MAX_TABLE_LENGTH
+    unsigned int minLength = 0; //of the shortest code, 0 for an empty table
+    unsigned int maxLength = 0; //of the longest code
+    unsigned int primaryBits = PRIMARY_BITS; //lookup width of the primary tables
+
+    static void fill(std::vector<Entry>& table, size_t offset, unsigned int width, uint64_t code, unsigned int length, char c){
+      uint64_t first = code << (width - length);
+      uint64_t count = uint64_t(1) << (width - length);
+      for(uint64_t i=0; i<count; i++){
+        Entry& e = table[offset + first + i];
+        e.symbols[0] = (unsigned char)c;
+        e.count = 1;
+        e.length = length;
+      }
+    }
+    //width of the primary tables for codes up to maxLength bits long, 11 bits unless a 12 bit
+    //table holds every code, narrower tables pair fewer symbols and were not faster
+    static unsigned int lookupBits(unsigned int maxLength){
+      return maxLength <= PRIMARY_BITS ? PRIMARY_BITS : MAX_PRIMARY_BITS;
+    }
+    //decodes the symbol at the reader position if it sits beyond the primary table,
+    //at least primaryBits + MAX_SECONDARY_BITS bits have to be buffered
+    //returns false when no code matches
+    bool decodeLong(const Entry& e, BitReader& reader, char& c, unsigned int& length) const {
+      if(e.link == LINK_NONE) return false;
+      uint64_t bits = reader.peek();
+      unsigned int sub = (bits << primaryBits) >> (64 - e.length);
+      const Entry& s = secondary[e.link + sub];
+      if(s.count){
+        c = s.symbols[0];
+        length = primaryBits + s.length;
+        return true;
+      }
+      uint64_t pos = reader.position();
+      for(const std::pair<BitSymbol,char>& p : longSymbols){
+        unsigned int symbolLen = p.first.getLength();
+        if(reader.readBitsAt(pos, symbolLen) == p.first.getBits()){
+          c = p.second;
+          length = symbolLen;
+          return true;
+        }
+      }
+      return false;
+    }
+  public:
+    DecodeTable(){}
+    DecodeTable(const std::map<BitSymbol,char>& symbolSubstMap){
+      this->assign(EncodeTable(symbolSubstMap));
+    }
+    //canonical code with the given lengths, see EncodeTable
+    DecodeTable(const unsigned char codeLengths[256]){
+      this->assign(EncodeTable(codeLengths));
+    }
+    //rebuilds the table for another code, reusing the memory of the previous one
+    //the lookup width follows the longest code (see lookupBits)
+    //without pairs only the single-symbol table is built, PRIMARY_BITS wide, such tables only
+    //decode through decodeContexts once paired by pairContexts
+    void assign(const EncodeTable& code, bool pairs = true){
+      minLength = 0;
+      maxLength = 0;
+      for(int c=0; c<256; c++){
+        unsigned int len = code.length(c);
+        if(len == 0) continue;
+        if(minLength == 0 || len < minLength) minLength = len;
+        maxLength = std::max(maxLength, len);
+      }
+      primaryBits = (pairs ? lookupBits(maxLength) : PRIMARY_BITS);
+      const unsigned int primarySize = 1 << primaryBits;
+      const unsigned int maxTableLength = primaryBits + MAX_SECONDARY_BITS;
+      single.assign(primarySize, Entry());
+      secondary.clear();
+      longSymbols.clear();
+      //widths of the second-level tables, indexed by primary prefix
+      unsigned char secondaryWidth[1 << MAX_PRIMARY_BITS] = {0};
+      for(int c=0; c<256; c++){
+        unsigned int len = code.length(c);
+        if(len == 0) continue;
+        uint64_t bits = code.code(c);
+        if(len <= primaryBits){
+          fill(single, 0, primaryBits, bits, len, c);
+        }else{
+          unsigned int prefix = bits >> (len - primaryBits);
+          unsigned int width = (len - primaryBits < MAX_SECONDARY_BITS ? len - primaryBits : MAX_SECONDARY_BITS);
+          secondaryWidth[prefix] = std::max<unsigned int>(secondaryWidth[prefix], width);
+          if(len > maxTableLength){
+            BitSymbol symbol;
+            symbol.addBits(bits, len);
+            longSymbols.push_back(std::make_pair(symbol, (char)c));
+          }
+        }
+      }
+      for(unsigned int prefix=0; prefix<primarySize; prefix++){
+        if(secondaryWidth[prefix] == 0) continue;
+        single[prefix].link = secondary.size();
+        single[prefix].length = secondaryWidth[prefix];
+        secondary.resize(secondary.size() + (size_t(1) << secondaryWidth[prefix]));
+      }
+      for(int c=0; c<256; c++){
+        unsigned int len = code.length(c);
+        if(len <= primaryBits || len > maxTableLength) continue;
+        uint64_t bits = code.code(c);
+        const Entry& e = single[bits >> (len - primaryBits)];
+        uint64_t rest = bits & ((uint64_t(1) << (len - primaryBits)) - 1);
+        fill(secondary, e.link, e.length, rest, len - primaryBits, c);
+      }
+      if(!pairs){
+        multi.clear();
+        return;
+      }
+      //pair up symbols whose combined length still fits the primary index
+      multi = single;
+      for(unsigned int i=0; i<primarySize; i++){
+        Entry& e = multi[i];
+        if(e.count != 1 || e.length >= primaryBits) continue;
+        unsigned int next = (i << e.length) & (primarySize - 1);
+        const Entry& n = single[next];
+        if(n.count != 1 || e.length + n.length > primaryBits) continue;
+        e.symbols[1] = n.symbols[0];
+        e.count = 2;
+        e.length += n.length;
+      }
+    }
+
+    //decodes symbols until the stream is exhausted or an unknown code is met
+    //returns false in the latter case
+    bool decode(const BitStream& enc, std::string& dec, uint64_t& bitPos) const {
+      const std::vector<unsigned char>& data = enc.getData();
+      return this->decode(data.data(), data.size(), enc.getLength(), dec, bitPos);
+    }
+    //as above for totalBits bits of raw data, appended to dec
+    bool decode(const unsigned char* data, size_t size, uint64_t totalBits, std::string& dec, uint64_t& bitPos) const {
+      //every symbol takes at least minLength bits
+      size_t capacity = (minLength == 0 ? 0 : totalBits / minLength);
+      size_t start = dec.size();
+      dec.resize(start + capacity);
+      size_t written = 0;
+      bool ok = this->decode(data, size, totalBits, &dec[start], capacity, written, bitPos);
+      dec.resize(start + written);
+      return ok;
+    }
+    //as above for totalBits bits of raw data into out, stops after capacity symbols
+    //picks the decoder specialized for the table's width and longest code
+    bool decode(const unsigned char* data, size_t size, uint64_t totalBits, char* out, size_t capacity, size_t& written, uint64_t& bitPos) const {
+      if(maxLength <= PRIMARY_BITS) return this->decodeKernel<PRIMARY_BITS, false>(data, size, totalBits, out, capacity, written, bitPos);
+      if(maxLength > MAX_PRIMARY_BITS) return this->decodeKernel<MAX_PRIMARY_BITS, true>(data, size, totalBits, out, capacity, written, bitPos);
+      return this->decodeKernel<MAX_PRIMARY_BITS, false>(data, size, totalBits, out, capacity, written, bitPos);
+    }
+  private:
+    template<unsigned int Width, bool Long>
+    bool decodeKernel(const unsigned char* data, size_t size, uint64_t totalBits, char* out, size_t capacity, size_t& written, uint64_t& bitPos) const {
+#ifdef HUFFMAN_X86_KERNELS
+      if(Kernels::active() >= Kernels::BMI2) return this->decodeWidthBmi2<Width, Long>(data, size, totalBits, out, capacity, written, bitPos);
+#endif
+      return this->decodeWidth<Width, Long>(data, size, totalBits, out, capacity, written, bitPos);
+    }
+    //the decoders are specialized on the lookup width of the table, so the index shift and
+    //the number of lookups per refill are constants, and on whether codes can be longer
+    //than that (Long), without them a missing entry is simply an invalid code
+    template<unsigned int Width, bool Long>
+    bool decodeWidth(const unsigned char* data, size_t size, uint64_t totalBits, char* out, size_t capacity, size_t& written, uint64_t& bitPos) const {
+      //lookups the 56 bits of a refill cover, with long codes the last one may need a secondary lookup too
+      const unsigned int perRefill = (Long ? 56 - MAX_SECONDARY_BITS : 56) / Width;
+      BitReader reader(data, size);
+      reader.refill();
+      const Entry* multiTable = multi.data();
+      char* dec = out;
+      char* const decEnd = out + capacity;
+      char c;
+      unsigned int length;
+      bool ok = true;
+      //fast path: at least one full buffer of input and room for perRefill symbol pairs remain
+      while(ok && reader.position() + 64 <= totalBits && decEnd - dec >= 2*perRefill){
+        reader.refill();
+        for(unsigned int k=0; k<perRefill; k++){
+          const Entry& e = multiTable[reader.peek() >> (64 - Width)];
+          if(e.count){
+            dec[0] = (char)e.symbols[0];
+            dec[1] = (char)e.symbols[1];
+            dec += e.count;
+            reader.consume(e.length);
+            continue;
+          }
+          if(!Long || !decodeLong(e, reader, c, length)){
+            ok = false;
+            break;
+          }
+          *dec++ = c;
+          reader.seek(reader.position() + length);
+          break;
+        }
+      }
+      //tail: one symbol at a time, never reading past the last bit
+      while(ok && reader.position() < totalBits && dec < decEnd){
+        reader.refill();
+        const Entry& e = single[reader.peek() >> (64 - Width)];
+        if(e.count){
+          c = e.symbols[0];
+          length = e.length;
+        }else if(!Long || !decodeLong(e, reader, c, length)){
+          ok = false;
+          break;
+        }
+        if(reader.position() + length > totalBits) break;
+        *dec++ = c;
+        reader.seek(reader.position() + length);
+      }
+      written = dec - out;
+      bitPos = reader.position();
+      return ok;
+    }
+#ifdef HUFFMAN_X86_KERNELS
+    //the decoders compiled for BMI2, with the bit reader inlined
+    template<unsigned int Width, bool Long>
+    __attribute__((target("bmi2"), flatten)) bool decodeWidthBmi2(const unsigned char* data, size_t size, uint64_t totalBits, char* out, size_t capacity, size_t& written, uint64_t& bitPos) const {
+      return this->decodeWidth<Width, Long>(data, size, totalBits, out, capacity, written, bitPos);
+    }
+    template<unsigned int Width, bool Long>
+    __attribute__((target("bmi2"), flatten)) bool decodeInterleavedBmi2(const unsigned char* const data[], const size_t sizes[], unsigned int streams, char* out, size_t count) const {
+      return this->decodeInterleavedStreams<Width, Long>(data, sizes, streams, out, count);
+    }
+    __attribute__((target("bmi2"), flatten)) static bool decodeContextsBmi2(const DecodeTable* tables, const unsigned char contextMap[256], const unsigned char* data, size_t size, char* out, size_t count){
+      return DecodeTable::decodeContextsScalar(tables, contextMap, data, size, out, count);
+    }
+    //Streams (4 or 8) streams in the 64-bit lanes of Streams/4 vectors, for codes of at most
+    //Width bits: one gather refills all lanes, one gathers their table entries
+    //the lanes run while every stream has 128 bits left, so refills never load past its end,
+    //the rest is decoded one symbol at a time as in decodeInterleavedWidth
+    template<unsigned int Width, unsigned int Streams>
+    __attribute__((target("avx2,bmi2"))) bool decodeInterleavedAvx2(const unsigned char* const data[], const size_t sizes[], char* out, size_t count) const {
+      const unsigned int vectors = Streams / 4;
+      const unsigned int perRefill = 56 / Width;
+      const __m256i byteSwap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                                7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+      //symbols[0] of the four lanes to bytes 0-1 of the low and 2-3 of the high half
+      const __m256i pickSymbols = _mm256_setr_epi8(4, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                   -1, -1, 4, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m256i countMask = _mm256_set1_epi64x(0x00FF000000000000LL);
+      const __m256i zero = _mm256_setzero_si256();
+      const __m256i full = _mm256_set1_epi64x(56);
+      const __m256i seven = _mm256_set1_epi64x(63);
+      const long long* table = (const long long*)single.data();
+      __m256i buffer[vectors], bitCount[vectors], address[vectors];
+      __m256i invalid = zero;
+      for(unsigned int v=0; v<vectors; v++){
+        buffer[v] = zero;
+        bitCount[v] = zero;
+        address[v] = _mm256_setr_epi64x((long long)data[4*v], (long long)data[4*v+1], (long long)data[4*v+2], (long long)data[4*v+3]);
+      }
+      uint64_t totalBits[Streams];
+      for(unsigned int k=0; k<Streams; k++) totalBits[k] = uint64_t(sizes[k])*8;
+      const unsigned int roundBits = std::max(maxLength, 1u);
+      uint64_t positions[Streams];
+      size_t i = 0;
+      while(true){
+        //bit positions of the streams and the rounds none of them can run out in
+        uint64_t addresses[Streams], counts[Streams];
+        for(unsigned int v=0; v<vectors; v++){
+          _mm256_storeu_si256((__m256i*)(addresses + 4*v), address[v]);
+          _mm256_storeu_si256((__m256i*)(counts + 4*v), bitCount[v]);
+        }
+        uint64_t rounds = (count - i) / Streams;
+        for(unsigned int k=0; k<Streams; k++){
+          positions[k] = (addresses[k] - (uint64_t)data[k])*8 - counts[k];
+          uint64_t left = (positions[k] + 128 <= totalBits[k] ? totalBits[k] - positions[k] - 128 : 0);
+          rounds = std::min(rounds, left / roundBits);
+        }
+        if(rounds < perRefill) break;
+        for(uint64_t r=0; r+perRefill<=rounds; r+=perRefill){
+          for(unsigned int v=0; v<vectors; v++){
+            __m256i words = _mm256_shuffle_epi8(_mm256_i64gather_epi64((const long long*)0, address[v], 1), byteSwap);
+            buffer[v] = _mm256_or_si256(buffer[v], _mm256_srlv_epi64(words, bitCount[v]));
+            address[v] = _mm256_add_epi64(address[v], _mm256_srli_epi64(_mm256_sub_epi64(seven, bitCount[v]), 3));
+            bitCount[v] = _mm256_or_si256(bitCount[v], full);
+          }
+          for(unsigned int p=0; p<perRefill; p++){
+            for(unsigned int v=0; v<vectors; v++){
+              __m256i entries = _mm256_i64gather_epi64(table, _mm256_srli_epi64(buffer[v], 64 - Width), 8);
+              __m256i lengths = _mm256_srli_epi64(entries, 56);
+              buffer[v] = _mm256_sllv_epi64(buffer[v], lengths);
+              bitCount[v] = _mm256_sub_epi64(bitCount[v], lengths);
+              invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi64(_mm256_and_si256(entries, countMask), zero));
+              __m256i symbols = _mm256_shuffle_epi8(entries, pickSymbols);
+              uint32_t four = _mm_cvtsi128_si32(_mm_or_si128(_mm256_castsi256_si128(symbols), _mm256_extracti128_si256(symbols, 1)));
+              memcpy(out + i + 4*v, &four, 4);
+            }
+            i += Streams;
+          }
+        }
+        if(!_mm256_testz_si256(invalid, invalid)) return false;
+      }
+      //tail: one symbol at a time, never reading past the end of a stream
+      BitReader readers[Streams];
+      for(unsigned int k=0; k<Streams; k++){
+        readers[k] = BitReader(data[k], sizes[k]);
+        readers[k].seek(positions[k]);
+      }
+      for(; i<count; i++){
+        BitReader& reader = readers[i % Streams];
+        reader.refill();
+        const Entry& e = single[reader.peek() >> (64 - Width)];
+        if(e.count == 0 || reader.position() + e.length > totalBits[i % Streams]) return false;
+        out[i] = e.symbols[0];
+        reader.seek(reader.position() + e.length);
+      }
+      return true;
+    }
+#endif
+    template<unsigned int Width, unsigned int Streams, bool Long>
+    bool decodeInterleavedWidth(const unsigned char* const data[], const size_t sizes[], char* out, size_t count) const {
+      //rounds of one symbol per stream the 56 bits of a refill cover, with long codes one
+      const unsigned int perRefill = (Long ? 1 : 56 / Width);
+      BitReader readers[Streams];
+      uint64_t totalBits[Streams];
+      for(unsigned int k=0; k<Streams; k++){
+        readers[k] = BitReader(data[k], sizes[k]);
+        readers[k].refill();
+        totalBits[k] = uint64_t(sizes[k])*8;
+      }
+      const Entry* singleTable = single.data();
+      const unsigned int roundBits = std::max(maxLength, 1u);
+      size_t i = 0;
+      char c;
+      unsigned int length;
+      while(true){
+        //rounds in which no stream can run out of buffered input
+        uint64_t rounds = (count - i) / Streams;
+        for(unsigned int k=0; k<Streams; k++){
+          uint64_t pos = readers[k].position();
+          uint64_t left = (pos + 64 <= totalBits[k] ? totalBits[k] - pos - 64 : 0);
+          rounds = std::min(rounds, left / roundBits);
+        }
+        if(rounds < perRefill) break;
+        for(uint64_t r=0; r+perRefill<=rounds; r+=perRefill){
+          for(unsigned int k=0; k<Streams; k++) readers[k].refill();
+          for(unsigned int p=0; p<perRefill; p++){
+            for(unsigned int k=0; k<Streams; k++){
+              BitReader& reader = readers[k];
+              const Entry& e = singleTable[reader.peek() >> (64 - Width)];
+              if(e.count){
+                out[i++] = (char)e.symbols[0];
+                reader.consume(e.length);
+                continue;
+              }
+              if(!Long || !decodeLong(e, reader, c, length)) return false;
+              out[i++] = c;
+              if(length > 56){
+                reader.seek(reader.position() + length);
+              }else{
+                reader.consume(length);
+              }
+            }
+          }
+        }
+      }
+      //tail: one symbol at a time, never reading past the end of a stream
+      for(; i<count; i++){
+        BitReader& reader = readers[i % Streams];
+        reader.refill();
+        const Entry& e = singleTable[reader.peek() >> (64 - Width)];
+        if(e.count){
+          c = e.symbols[0];
+          length = e.length;
+        }else if(!Long || !decodeLong(e, reader, c, length)){
+          return false;
+        }
+        if(reader.position() + length > totalBits[i % Streams]) return false;
+        out[i] = c;
+        reader.seek(reader.position() + length);
+      }
+      return true;
+    }
+    template<unsigned int Width, bool Long>
+    bool decodeInterleavedStreams(const unsigned char* const data[], const size_t sizes[], unsigned int streams, char* out, size_t count) const {
+      switch(streams){
+        case 1: return this->decodeInterleavedWidth<Width, 1, Long>(data, sizes, out, count);
+        case 2: return this->decodeInterleavedWidth<Width, 2, Long>(data, sizes, out, count);
+        case 3: return this->decodeInterleavedWidth<Width, 3, Long>(data, sizes, out, count);
+        case 4: return this->decodeInterleavedWidth<Width, 4, Long>(data, sizes, out, count);
+        case 5: return this->decodeInterleavedWidth<Width, 5, Long>(data, sizes, out, count);
+        case 6: return this->decodeInterleavedWidth<Width, 6, Long>(data, sizes, out, count);
+        case 7: return this->decodeInterleavedWidth<Width, 7, Long>(data, sizes, out, count);
+        case 8: return this->decodeInterleavedWidth<Width, 8, Long>(data, sizes, out, count);
+      }
+      return false;
+    }
+    template<unsigned int Width, bool Long>
+    bool decodeInterleavedKernel(const unsigned char* const data[], const size_t sizes[], unsigned int streams, char* out, size_t count) const {
+#ifdef HUFFMAN_X86_KERNELS
+      Kernels::Level level = Kernels::active();
+      if(level >= Kernels::AVX2 && !Long && streams == 4) return this->decodeInterleavedAvx2<Width, 4>(data, sizes, out, count);
+      if(level >= Kernels::AVX2 && !Long && streams == 8) return this->decodeInterleavedAvx2<Width, 8>(data, sizes, out, count);
+      if(level >= Kernels::BMI2) return this->decodeInterleavedBmi2<Width, Long>(data, sizes, streams, out, count);
+#endif
+      return this->decodeInterleavedStreams<Width, Long>(data, sizes, streams, out, count);
+    }
+  public:
+
+    //pairs up symbols in tables built without pairs for decodeContexts: the second symbol of
+    //an entry is the one the table for the first symbol's context decodes next
+    static void pairContexts(DecodeTable* tables, unsigned int count, const unsigned char contextMap[256]){
+      const unsigned int primarySize = 1 << PRIMARY_BITS;
+      for(unsigned int k=0; k<count; k++){
+        DecodeTable& t = tables[k];
+        t.multi = t.single;
+        for(unsigned int i=0; i<primarySize; i++){
+          Entry& e = t.multi[i];
+          if(e.count != 1 || e.length >= PRIMARY_BITS) continue;
+          unsigned int next = (i << e.length) & (primarySize - 1);
+          const Entry& n = tables[contextMap[e.symbols[0]]].single[next];
+          if(n.count != 1 || e.length + n.length > PRIMARY_BITS) continue;
+          e.symbols[1] = n.symbols[0];
+          e.count = 2;
+          e.length += n.length;
+        }
+      }
+    }
+    //decodes count symbols coded with one of several tables chosen by the previous symbol,
+    //contextMap holds the table for each previous byte (see ContextModel), the first symbol follows a 0
+    //the tables have to be paired with pairContexts
+    static bool decodeContexts(const DecodeTable* tables, const unsigned char contextMap[256], const unsigned char* data, size_t size, char* out, size_t count){
+#ifdef HUFFMAN_X86_KERNELS
+      if(Kernels::active() >= Kernels::BMI2) return DecodeTable::decodeContextsBmi2(tables, contextMap, data, size, out, count);
+#endif
+      return DecodeTable::decodeContextsScalar(tables, contextMap, data, size, out, count);
+    }
+  private:
+    static bool decodeContextsScalar(const DecodeTable* tables, const unsigned char contextMap[256], const unsigned char* data, size_t size, char* out, size_t count){
+      //the table switch per symbol is one lookup by the previous byte
+      const DecodeTable* byPrevious[256];
+      const Entry* primary[256];
+      const Entry* paired[256];
+      for(int p=0; p<256; p++){
+        byPrevious[p] = &tables[contextMap[p]];
+        primary[p] = byPrevious[p]->single.data();
+        paired[p] = byPrevious[p]->multi.data();
+      }
+      BitReader reader(data, size);
+      reader.refill();
+      const uint64_t totalBits = uint64_t(size)*8;
+      const unsigned int perRefill = 4; //56 buffered bits cover 4 primary lookups and the lookup of a long code
+      unsigned char previous = 0;
+      size_t i = 0;
+      char c;
+      unsigned int length;
+      //fast path: a full buffer of input left, up to perRefill entries of up to 2 symbols per refill
+      while(i + 2*perRefill <= count && reader.position() + 64 <= totalBits){
+        reader.refill();
+        for(unsigned int k=0; k<perRefill; k++){
+          const Entry& e = paired[previous][reader.peek() >> (64 - PRIMARY_BITS)];
+          if(e.count){
+            out[i] = (char)e.symbols[0];
+            out[i+1] = (char)e.symbols[1];
+            i += e.count;
+            previous = e.symbols[e.count - 1];
+            reader.consume(e.length);
+            continue;
+          }
+          if(!byPrevious[previous]->decodeLong(e, reader, c, length)) return false;
+          out[i++] = c;
+          previous = c;
+          reader.seek(reader.position() + length);
+          break;
+        }
+      }
+      //tail: one symbol at a time, never reading past the last bit
+      for(; i<count; i++){
+        reader.refill();
+        const Entry& e = primary[previous][reader.peek() >> (64 - PRIMARY_BITS)];
+        if(e.count){
+          c = e.symbols[0];
+          length = e.length;
+        }else if(!byPrevious[previous]->decodeLong(e, reader, c, length)){
+          return false;
+        }
+        if(reader.position() + length > totalBits) return false;
+        out[i] = c;
+        previous = c;
+        reader.seek(reader.position() + length);
+      }
+      return true;
+    }
+  public:
+
+    static const unsigned int MAX_STREAMS = 8;
+    //decodes count symbols spread round-robin over streams independent bit streams
+    //(symbol i is in stream i % streams), all streams are advanced in the same loop
+    //picks the decoder specialized for the table's width, longest code and stream count
+    bool decodeInterleaved(const unsigned char* const data[], const size_t sizes[], unsigned int streams, char* out, size_t count) const {
+      if(maxLength <= PRIMARY_BITS) return this->decodeInterleavedKernel<PRIMARY_BITS, false>(data, sizes, streams, out, count);
+      if(maxLength > MAX_PRIMARY_BITS) return this->decodeInterleavedKernel<MAX_PRIMARY_BITS, true>(data, sizes, streams, out, count);
+      return this->decodeInterleavedKernel<MAX_PRIMARY_BITS, false>(data, sizes, streams, out, count);
+    }
+};
+
+//counters for --stats, filled by the codec when given one and printed once at the end
+//updates are relaxed atomics, blocks coded on several threads add up their phase times,
+//so those can exceed the wall time
+class Stats{
+  public:
+    enum Phase{READ, TRANSFORM, HISTOGRAM, BUILD, CODE, CHECKSUM, SERIALIZE, WRITE, PHASES};
+    std::atomic<uint64_t> nanoseconds[PHASES];
+    std::atomic<uint64_t> rawBytes{0}; //uncompressed bytes read or written
+    std::atomic<uint64_t> archiveBytes{0}; //archive bytes read or written
+    std::atomic<uint64_t> symbols{0}; //coded or decoded symbols
+    std::atomic<uint64_t> codedBits{0}; //bits of coded data, without tables and headers
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> storedBlocks{0}; //blocks kept raw because coding did not pay
+    std::atomic<uint64_t> reusedTables{0}; //blocks coded with an earlier block's table
+    std::atomic<uint64_t> contextBlocks{0}; //blocks coded with order-1 context tables
+    Stats(){
+      for(int p=0; p<PHASES; p++) nanoseconds[p] = 0;
+    }
+    static const char* phaseName(int phase){
+      static const char* names[PHASES] = {"read", "transform", "histogram", "code build", "encode/decode", "checksum", "serialize", "write"};
+      return names[phase];
+    }
+    //adds its lifetime to a phase, does nothing without stats
+    class Timer{
+      private:
+        Stats* stats;
+        Phase phase;
+        std::chrono::steady_clock::time_point start;
+      public:
+        Timer(Stats* stats, Phase phase){
+          this->stats = stats;
+          this->phase = phase;
+          if(stats) start = std::chrono::steady_clock::now();
+        }
+        ~Timer(){
+          this->stop();
+        }
+        //ends the phase before the end of the scope
+        void stop(){
+          if(!stats) return;
+          uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+          stats->nanoseconds[phase].fetch_add(ns, std::memory_order_relaxed);
+          stats = NULL;
+        }
+    };
+    //archive bits per original byte, headers and tables included
+    double bitsPerSymbol() const {
+      return symbols ? 8.0 * archiveBytes / symbols : 0;
+    }
+    //coded bits per symbol, without headers and tables
+    double averageCodeLength() const {
+      return symbols ? double(codedBits) / symbols : 0;
+    }
+    //extracting swaps which of raw and archive bytes are the input
+    void print(std::ostream& out, bool extracting, double wallSeconds) const {
+      std::ios::fmtflags flags = out.flags();
+      out << std::fixed << std::setprecision(6);
+      for(int p=0; p<PHASES; p++){
+        out << std::left << std::setw(20) << phaseName(p) << std::right << std::setw(14) << nanoseconds[p] / 1e9 << " s" << std::endl;
+      }
+      out << std::left << std::setw(20) << "wall" << std::right << std::setw(14) << wallSeconds << " s" << std::endl;
+      out << std::left << std::setw(20) << "bytes in" << std::right << std::setw(14) << (extracting ? archiveBytes : rawBytes) << std::endl;
+      out << std::left << std::setw(20) << "bytes out" << std::right << std::setw(14) << (extracting ? rawBytes : archiveBytes) << std::endl;
+      out << std::left << std::setw(20) << "blocks" << std::right << std::setw(14) << blocks << std::endl;
+      out << std::left << std::setw(20) << "stored blocks" << std::right << std::setw(14) << storedBlocks << std::endl;
+      out << std::left << std::setw(20) << "reused tables" << std::right << std::setw(14) << reusedTables << std::endl;
+      out << std::left << std::setw(20) << "context blocks" << std::right << std::setw(14) << contextBlocks << std::endl;
+      out << std::setprecision(4);
+      out << std::left << std::setw(20) << "bits per symbol" << std::right << std::setw(14) << bitsPerSymbol() << std::endl;
+      out << std::left << std::setw(20) << "avg code length" << std::right << std::setw(14) << averageCodeLength() << std::endl;
+      out.flags(flags);
+    }
+    void printJson(std::ostream& out, bool extracting, double wallSeconds) const {
+      out << "{\"phases\": {";
+      for(int p=0; p<PHASES; p++) out << (p ? ", " : "") << "\"" << phaseName(p) << "\": " << nanoseconds[p] / 1e9;
+      out << "}, \"wallSeconds\": " << wallSeconds
+          << ", \"bytesIn\": " << (extracting ? archiveBytes : rawBytes)
+          << ", \"bytesOut\": " << (extracting ? rawBytes : archiveBytes)
+          << ", \"blocks\": " << blocks
+          << ", \"storedBlocks\": " << storedBlocks
+          << ", \"reusedTables\": " << reusedTables
+          << ", \"contextBlocks\": " << contextBlocks
+          << ", \"bitsPerSymbol\": " << bitsPerSymbol()
+          << ", \"averageCodeLength\": " << averageCodeLength() << "}" << std::endl;
+    }
+};
+
+//fixed set of worker threads running indexed tasks, the calling thread helps out
+class ThreadPool{
+  private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t, unsigned int)>* task = NULL; //valid while forEach runs
+    size_t taskCount = 0;
+    std::atomic<size_t> nextTask{0};
+    size_t busyWorkers = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+    void runTasks(unsigned int worker){
+      while(true){
+        size_t i = nextTask++;
+        if(i >= taskCount) break;
+        (*task)(i, worker);
+      }
+    }
+    void workerLoop(unsigned int worker){
+      uint64_t seen = 0;
+      while(true){
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          wake.wait(lock, [&]{ return stopping || generation != seen; });
+          if(stopping) return;
+          seen = generation;
+          busyWorkers++;
+        }
+        runTasks(worker);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          busyWorkers--;
+        }
+        done.notify_all();
+      }
+    }
+  public:
+    //threads counts the caller too, 0 means one per hardware thread
+    ThreadPool(unsigned int threads){
+      if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+      for(unsigned int i=1; i<threads; i++) workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+    ~ThreadPool(){
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      for(std::thread& t : workers) t.join();
+    }
+    unsigned int size() const {
+      return workers.size() + 1;
+    }
+    //runs fn(0) .. fn(count-1) in any order and returns when all of them are done
+    void forEach(size_t count, const std::function<void(size_t)>& fn){
+      this->forEach(count, [&fn](size_t i, unsigned int){ fn(i); });
+    }
+    //as above, fn also gets the index of the thread running it (0 .. size()-1, 0 is the caller)
+    //for per-thread scratch space
+    void forEach(size_t count, const std::function<void(size_t, unsigned int)>& fn){
+      if(workers.empty() || count < 2){
+        for(size_t i=0; i<count; i++) fn(i, 0);
+        return;
+      }
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        //late workers of the previous round may still be looking at the old task
+        done.wait(lock, [&]{ return busyWorkers == 0; });
+        task = &fn;
+        taskCount = count;
+        nextTask = 0;
+        generation++;
+      }
+      wake.notify_all();
+      runTasks(0);
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [&]{ return busyWorkers == 0 && nextTask >= taskCount; });
+    }
+};
+
+//byte histogram kernels
+//counts go to four interleaved tables so runs of the same byte do not serialize
+//on one counter's store-to-load forwarding, the tables are summed at the end
+class Histogram{
+  public:
+    static const size_t PARALLEL_CHUNK = 1 << 20; //smallest share worth a thread
+    //adds the byte counts of data to frequencies
+    static void count(const unsigned char* data, size_t length, uint64_t frequencies[256]){
+      uint64_t tables[4][256];
+      memset(tables, 0, sizeof(tables));
+      size_t i = 0;
+      for(; i + 16 <= length; i += 16){
+        uint64_t a, b;
+        memcpy(&a, data + i, 8);
+        memcpy(&b, data + i + 8, 8);
+        for(int shift=0; shift<64; shift+=16){
+          tables[0][(a >> shift) & 0xFF]++;
+          tables[1][(a >> (shift + 8)) & 0xFF]++;
+          tables[2][(b >> shift) & 0xFF]++;
+          tables[3][(b >> (shift + 8)) & 0xFF]++;
+        }
+      }
+      for(; i < length; i++) tables[0][data[i]]++;
+      for(int c=0; c<256; c++) frequencies[c] += tables[0][c] + tables[1][c] + tables[2][c] + tables[3][c];
+    }
+    //as count, large buffers are split across the pool
+    static void count(const unsigned char* data, size_t length, uint64_t frequencies[256], ThreadPool& pool){
+      size_t chunks = std::min<size_t>(pool.size(), length / PARALLEL_CHUNK);
+      if(chunks < 2){
+        Histogram::count(data, length, frequencies);
+        return;
+      }
+      size_t chunkSize = (length + chunks - 1) / chunks;
+      std::vector<std::vector<uint64_t>> partial(chunks, std::vector<uint64_t>(256, 0));
+      pool.forEach(chunks, [&](size_t i){
+        size_t start = i * chunkSize;
+        Histogram::count(data + start, std::min(chunkSize, length - start), partial[i].data());
+      });
+      for(const std::vector<uint64_t>& f : partial){
+        for(int c=0; c<256; c++) frequencies[c] += f[c];
+      }
+    }
+    //estimates the histogram from every stride-th block only, every byte value
+    //keeps a count of at least one so a code built from it covers any input
+    static void countSampled(const unsigned char* data, size_t length, uint32_t blockSize, unsigned int stride, uint64_t frequencies[256], ThreadPool& pool){
+      size_t blockCount = (length + blockSize - 1) / blockSize;
+      size_t samples = (blockCount + stride - 1) / stride;
+      std::vector<std::vector<uint64_t>> partial(samples, std::vector<uint64_t>(256, 0));
+      pool.forEach(samples, [&](size_t i){
+        size_t start = i * stride * size_t(blockSize);
+        Histogram::count(data + start, std::min<size_t>(blockSize, length - start), partial[i].data());
+      });
+      for(const std::vector<uint64_t>& f : partial){
+        for(int c=0; c<256; c++) frequencies[c] += f[c];
+      }
+      for(int c=0; c<256; c++) frequencies[c] = std::max<uint64_t>(frequencies[c], 1);
+    }
+};
+
+class Huffman{
+  public:
+    static const unsigned int MAX_CODE_LENGTH = 64; //what BitSymbol and the v1 header can hold
+  private:
+    //minimum-redundancy code lengths with the two-queue method, the n weights must be sorted ascending
+    static void huffmanLengths(const uint64_t* weights, size_t n, unsigned char* lengths){
+      if(n == 1) lengths[0] = 1;
+      if(n < 2) return;
+      //nodes 0..n-1 are leaves, n.. are internal nodes in creation order
+      uint64_t nodeWeight[2*256 - 1];
+      uint16_t parent[2*256 - 1];
+      memcpy(nodeWeight, weights, n*sizeof(uint64_t));
+      size_t leaf = 0;
+      size_t internal = n;
+      for(size_t next = n; next < 2*n - 1; next++){
+        size_t children[2];
+        for(int k=0; k<2; k++){
+          //take the lighter front of the two queues, leaves on ties keep codes short
+          if(leaf < n && (internal >= next || weights[leaf] <= nodeWeight[internal])){
+            children[k] = leaf++;
+          }else{
+            children[k] = internal++;
+          }
+        }
+        nodeWeight[next] = nodeWeight[children[0]] + nodeWeight[children[1]];
+        parent[children[0]] = next;
+        parent[children[1]] = next;
+      }
+      //depths, parents are always created after their children
+      unsigned char depth[2*256 - 1];
+      depth[2*n - 2] = 0;
+      for(size_t i = 2*n - 2; i-- > 0;) depth[i] = depth[parent[i]] + 1;
+      memcpy(lengths, depth, n);
+    }
+
+    //optimal code lengths not exceeding maxLength with package-merge, the n weights must be sorted ascending
+    //every level only remembers which of its items are packages, the lengths are then
+    //recovered from the top level down: a taken leaf adds one bit to its symbol,
+    //a taken package takes its two items on the level below
+    static void packageMergeLengths(const uint64_t* weights, size_t n, unsigned int maxLength, unsigned char* lengths){
+      const size_t MAX_ITEMS = 2*256;
+      uint64_t lists[2][MAX_ITEMS];
+      uint64_t packageBits[MAX_CODE_LENGTH][MAX_ITEMS/64] = {{0}};
+      size_t listSize[MAX_CODE_LENGTH];
+      uint64_t* list = lists[0];
+      uint64_t* merged = lists[1];
+      memcpy(list, weights, n*sizeof(uint64_t));
+      listSize[0] = n;
+      for(unsigned int level=1; level<maxLength; level++){
+        //package neighbours and merge the packages with a fresh copy of the leaves
+        size_t packages = listSize[level-1] / 2;
+        size_t li = 0, pi = 0, m = 0;
+        while(li < n || pi < packages){
+          uint64_t package = (pi < packages ? list[2*pi] + list[2*pi + 1] : 0);
+          if(pi >= packages || (li < n && weights[li] <= package)){
+            merged[m++] = weights[li++];
+          }else{
+            packageBits[level][m/64] |= uint64_t(1) << (m%64);
+            merged[m++] = package;
+            pi++;
+          }
+        }
+        listSize[level] = m;
+        std::swap(list, merged);
+      }
+      memset(lengths, 0, n);
+      size_t take = 2*n - 2;
+      for(unsigned int level=maxLength; level-- > 0;){
+        take = std::min(take, listSize[level]);
+        size_t packagesTaken = 0;
+        for(size_t i=0; i<take; i++) packagesTaken += (packageBits[level][i/64] >> (i%64)) & 1;
+        for(size_t j=0; j<take - packagesTaken; j++) lengths[j]++;
+        take = 2*packagesTaken;
+      }
+    }
+
+    //code lengths for symbols sorted by descending frequency into codeLengths (0 for absent symbols)
+    //maxLength limits the code length (package-merge), 0 means MAX_CODE_LENGTH
+    static void sortedCodeLengths(const std::pair<char,uint64_t>* sortedSymbolFrequencies, size_t n, unsigned int maxLength, unsigned char codeLengths[256]){
+      if(maxLength == 0 || maxLength > MAX_CODE_LENGTH) maxLength = MAX_CODE_LENGTH;
+      while(maxLength < 64 && (uint64_t(1) << maxLength) < n) maxLength++; //the limit has to fit all symbols
+      //the input is sorted by descending frequency, both builders want it ascending
+      uint64_t weights[256];
+      unsigned char lengths[256];
+      for(size_t i=0; i<n; i++) weights[i] = sortedSymbolFrequencies[n-1-i].second;
+      Huffman::huffmanLengths(weights, n, lengths);
+      unsigned int longest = 0;
+      for(size_t i=0; i<n; i++) longest = std::max<unsigned int>(longest, lengths[i]);
+      if(longest > maxLength && n > 1) Huffman::packageMergeLengths(weights, n, maxLength, lengths);
+
+      memset(codeLengths, 0, 256);
+      for(size_t i=0; i<n; i++) codeLengths[(unsigned char)sortedSymbolFrequencies[n-1-i].first] = lengths[i];
+    }
+
+    //builds a minimum-redundancy prefix code, codes are assigned canonically
+    static std::map<BitSymbol,char> generateSymbols(const std::vector<std::pair<char,uint64_t>> &sortedSymbolFrequencies, unsigned int maxLength = 0){
+      unsigned char codeLengths[256];
+      Huffman::sortedCodeLengths(sortedSymbolFrequencies.data(), sortedSymbolFrequencies.size(), maxLength, codeLengths);
+      return Huffman::canonicalSymbols(codeLengths);
+    }
+
+  public:
+    //code lengths of a minimum-redundancy code for a byte histogram, 0 for absent bytes
+    //maxLength limits the code length, 0 means MAX_CODE_LENGTH, nothing is allocated
+    static void buildCodeLengths(const uint64_t frequencies[256], unsigned int maxLength, unsigned char codeLengths[256]){
+      std::pair<char,uint64_t> symbolsSort[256];
+      size_t n = 0;
+      for(int c=0; c<256; c++){
+        if(frequencies[c] > 0) symbolsSort[n++] = std::make_pair((char)c, frequencies[c]);
+      }
+      std::sort(symbolsSort, symbolsSort + n, comparePair);
+      Huffman::sortedCodeLengths(symbolsSort, n, maxLength, codeLengths);
+    }
+
+    //code for a byte histogram, see buildCodeLengths
+    static std::map<BitSymbol,char> buildSymbols(const uint64_t frequencies[256], unsigned int maxLength = 0){
+      unsigned char codeLengths[256];
+      Huffman::buildCodeLengths(frequencies, maxLength, codeLengths);
+      return Huffman::canonicalSymbols(codeLengths);
+    }
+
+    static void codeLengthsOf(const std::map<BitSymbol,char> &symbolSubstMap, unsigned char codeLengths[256]){
+      memset(codeLengths, 0, 256);
+      for(const auto &p : symbolSubstMap) codeLengths[(unsigned char)p.second] = p.first.getLength();
+    }
+
+    //canonical codes for the given lengths (0 = unused symbol): shorter codes first,
+    //codes of the same length ordered by symbol value
+    static std::map<BitSymbol,char> canonicalSymbols(const unsigned char codeLengths[256]){
+      std::map<BitSymbol,char> symbolSubstMap;
+      EncodeTable table(codeLengths);
+      for(unsigned int c=0; c<256; c++){
+        if(!table.contains(c)) continue;
+        BitSymbol bitSymbol;
+        bitSymbol.addBits(table.code(c), table.length(c));
+        symbolSubstMap[bitSymbol] = (char)c;
+      }
+      return symbolSubstMap;
+    }
+
+    //true if the lengths describe a prefix code (Kraft inequality)
+    static bool validCodeLengths(const unsigned char codeLengths[256]){
+      uint64_t available = 1; //unused codes at the current length
+      for(unsigned int length=1; length<=MAX_CODE_LENGTH; length++){
+        available *= 2;
+        for(unsigned int c=0; c<256; c++){
+          if(codeLengths[c] > MAX_CODE_LENGTH) return false;
+          if(codeLengths[c] != length) continue;
+          if(available == 0) return false;
+          available--;
+        }
+        if(available > 256) available = 256; //enough for any remaining symbols
+      }
+      return true;
+    }
+
+    //code lengths as run-length tokens: 0x00-0x40 is a single length,
+    //0x41-0x7F repeats the previous length 1-63 times, 0x80|k is a run of k+1 unused symbols
+    //writes at most 256 bytes to out and returns their number
+    static size_t packCodeLengths(const unsigned char codeLengths[256], unsigned char* out){
+      size_t pos = 0;
+      unsigned int i = 0;
+      while(i < 256){
+        unsigned int run = 1;
+        while(i + run < 256 && codeLengths[i + run] == codeLengths[i]) run++;
+        i += run;
+        if(codeLengths[i - run] == 0){
+          for(; run > 128; run -= 128) out[pos++] = 0xFF;
+          out[pos++] = 0x80 | (run - 1);
+          continue;
+        }
+        out[pos++] = codeLengths[i - run];
+        run--;
+        for(; run > 63; run -= 63) out[pos++] = 0x7F;
+        if(run > 0) out[pos++] = 0x40 + run;
+      }
+      return pos;
+    }
+    static std::string packCodeLengths(const unsigned char codeLengths[256]){
+      unsigned char packed[256];
+      size_t length = Huffman::packCodeLengths(codeLengths, packed);
+      return std::string((const char*)packed, length);
+    }
+
+    //returns the number of bytes read, 0 on malformed input
+    static size_t unpackCodeLengths(const unsigned char* serial, size_t length, unsigned char codeLengths[256]){
+      size_t pos = 0;
+      unsigned int i = 0;
+      while(i < 256){
+        if(pos >= length) return 0;
+        unsigned char token = serial[pos++];
+        unsigned int run = 1;
+        unsigned char length = token;
+        if(token & 0x80){
+          run = (token & 0x7F) + 1;
+          length = 0;
+        }else if(token > 0x40){
+          if(i == 0) return 0;
+          run = token - 0x40;
+          length = codeLengths[i-1];
+        }
+        if(i + run > 256) return 0;
+        for(unsigned int j=0; j<run; j++) codeLengths[i++] = length;
+      }
+      return pos;
+    }
+    static std::pair<BitStream,std::map<BitSymbol,char>> strEncode(const std::string& in, unsigned int maxCodeLength = 0){
+      uint64_t frequencies[256] = {0};
+      Histogram::count((const unsigned char*) in.data(), in.length(), frequencies);
+      std::vector<std::pair<char,uint64_t>> symbolsSort;
+      for(int c=0; c<256; c++){
+        if(frequencies[c] > 0) symbolsSort.push_back(std::make_pair((char)c, frequencies[c]));
+      }
+      std::sort(symbolsSort.begin(), symbolsSort.end(), comparePair);
+
+      //sorted, now generate symbols
+      std::map<BitSymbol,char> symbolSubstMap = Huffman::generateSymbols(symbolsSort, maxCodeLength);
+
+      EncodeTable encodeTable(symbolSubstMap);
+      //exact output size plus slack for the word-sized stores
+      uint64_t encodedBits = encodeTable.encodedBits(frequencies);
+      std::vector<unsigned char> encoded((encodedBits + 7)/8 + 8);
+      BitWriter writer(encoded.data());
+      if(encodedBits > 0) encodeTable.encode((const unsigned char*) in.data(), in.length(), writer);
+      encoded.resize(writer.finish());
+      return std::make_pair(BitStream::createFromBytes(std::move(encoded), encodedBits), std::move(symbolSubstMap));
+    }
+
+    static std::string strDecode(const BitStream& enc, const std::map<BitSymbol,char>& symbolSubstMap){
+      std::string dec;
+      DecodeTable table(symbolSubstMap);
+      uint64_t stringPos = 0;
+      if(!table.decode(enc, dec, stringPos)){
+        std::cerr << "Symbol not matched! stringPos=" << stringPos << std::endl;
+      }
+      return dec;
+    }
+
+    //format version 2: magic, version, flags, canonical code lengths, data
+    //flags bit 0: code lengths are run-length packed, bits 1-3: padding bits in the last byte
+    static std::string serialize(const BitStream& bitStream, const std::map<BitSymbol,char>& symbolSubstMap){
+      std::string ret;
+      Huffman::serialize(bitStream, symbolSubstMap, ret);
+      return ret;
+    }
+    //as above, appended to out, which is grown once to the exact length
+    //bits not yet finalized are padded in the output only, bitStream stays as it is
+    static void serialize(const BitStream& bitStream, const std::map<BitSymbol,char>& symbolSubstMap, std::string& out){
+      unsigned char codeLengths[256];
+      Huffman::codeLengthsOf(symbolSubstMap, codeLengths);
+      std::string packed = Huffman::packCodeLengths(codeLengths);
+      bool rle = packed.length() < 256;
+      const std::vector<unsigned char> &symbolCharacters = bitStream.getData();
+      unsigned char pending = bitStream.getPendingBits();
+      unsigned char padding = bitStream.getPaddingBits() + (pending ? 8 - pending : 0);
+      out.reserve(out.length() + 4 + (rle ? packed.length() : 256) + symbolCharacters.size() + (pending ? 1 : 0));
+      out += ((unsigned char)0xAD); //header part 1
+      out += ((unsigned char)0xBD); //header part 2
+      out += ((unsigned char)0x02); //version 2
+      out += ((unsigned char)((rle ? 0x01 : 0x00) | (padding << 1))); //flags
+      if(rle){
+        out += packed;
+      }else{
+        out.append((const char*)codeLengths, 256);
+      }
+      out.append((const char*)symbolCharacters.data(), symbolCharacters.size());
+      if(pending) out += bitStream.getPendingByte();
+    }
+
+    static std::pair<BitStream,std::map<BitSymbol,char>> deserialize(const std::string& serial){
+      std::map<BitSymbol,char> symbolSubstMap;
+      size_t dataStart;
+      unsigned char padding;
+      if(!Huffman::parseSerialized((const unsigned char*)serial.data(), serial.length(), symbolSubstMap, dataStart, padding)){
+        return std::make_pair(BitStream(), std::map<BitSymbol,char>()); //invalid or not supported
+      }
+      BitStream dataBitStream = BitStream::createFromBytes((const unsigned char*)serial.data() + dataStart, serial.length() - dataStart);
+      if(dataStart < serial.length()) dataBitStream.setPaddingBits(padding);
+      return std::make_pair(std::move(dataBitStream), std::move(symbolSubstMap));
+    }
+
+    //decodes a version 1 or 2 stream straight from its bytes and appends the result to out,
+    //without copying the coded data, codedBits is set to its length
+    //false if the header is malformed or the data holds an unknown code
+    static bool decodeSerialized(const unsigned char* serial, size_t length, std::string& out, uint64_t& codedBits){
+      std::map<BitSymbol,char> symbolSubstMap;
+      size_t dataStart;
+      unsigned char padding;
+      codedBits = 0;
+      if(!Huffman::parseSerialized(serial, length, symbolSubstMap, dataStart, padding)) return false;
+      size_t size = length - dataStart;
+      codedBits = (size == 0 ? 0 : size*8 - std::min<uint64_t>(padding, size*8));
+      DecodeTable table(symbolSubstMap);
+      uint64_t bitPos = 0;
+      return table.decode(serial + dataStart, size, codedBits, out, bitPos);
+    }
+
+  private:
+    //reads the header and code of a version 1 or 2 stream, the coded data starts at dataStart
+    //and has padding bits at its end, false if the header is invalid or of another version
+    static bool parseSerialized(const unsigned char* serial, size_t length, std::map<BitSymbol,char>& symbolSubstMap, size_t& dataStart, unsigned char& padding){
+      if(length < 4) return false; //invalid header
+      if(serial[0] != 0xAD || serial[1] != 0xBD) return false; //invalid format
+      if(serial[2] == 0x01) return Huffman::parseSerializedV1(serial, length, symbolSubstMap, dataStart, padding);
+      if(serial[2] != 0x02) return false; //not supported format version
+
+      unsigned char flags = serial[3];
+      unsigned char codeLengths[256] = {0};
+      dataStart = 4;
+      if(flags & 0x01){
+        size_t packedLength = Huffman::unpackCodeLengths(serial + dataStart, length - dataStart, codeLengths);
+        if(packedLength == 0) return false; //truncated table
+        dataStart += packedLength;
+      }else{
+        if(length < dataStart + 256) return false; //truncated table
+        memcpy(codeLengths, serial + dataStart, 256);
+        dataStart += 256;
+      }
+      if(!Huffman::validCodeLengths(codeLengths)) return false; //not a prefix code
+      symbolSubstMap = Huffman::canonicalSymbols(codeLengths);
+      padding = (flags >> 1) & 0x07;
+      return true;
+    }
+
+    static bool parseSerializedV1(const unsigned char* serial, size_t length, std::map<BitSymbol,char>& symbolSubstMap, size_t& dataStart, unsigned char& padding){
+      unsigned int symbolSubstMapSize = serial[3]; // 0 means 256
+      if(symbolSubstMapSize == 0) symbolSubstMapSize = 256;
+      //only the table is copied for bit access, each entry takes at most 8+6+64 bits
+      size_t tableBytes = std::min<size_t>(length - 4, (symbolSubstMapSize*(8+6+64) + 7)/8);
+      BitStream bitStream = BitStream::createFromBytes(serial + 4, tableBytes);
+      unsigned int bitCount = 0;
+      //parse symbol substitution map
+      for(unsigned int i=0; i<symbolSubstMapSize; i++){
+        //char (8b), symbolSize (6b), symbol (Xb)
+        char c = 0;
+        for(int j=0; j<8; j++){
+          c |= (bitStream.getSubBit(bitCount++) ? (0x01 << (7-j) ) : 0);
+        }
+        unsigned char symbolSize = 0;
+        for(int j=0; j<6; j++){
+          bool got = bitStream.getSubBit(bitCount++);
+          symbolSize |= (got ? (0x01 << (5-j) ) : 0);
+        }
+        if(symbolSize == 0) symbolSize = 64;
+        BitSymbol bitSymbol;
+        for(unsigned char j=0; j<symbolSize; j++){
+          bitSymbol.add(bitStream.getSubBit(bitCount++));
+        }
+        symbolSubstMap[bitSymbol] = c;
+      }
+      //discard padding to next byte
+      while(bitCount % 8 != 0) bitCount++;
+      dataStart = std::min<size_t>(length, 4 + bitCount/8);
+      padding = 0;
+      return true;
+    }
+};
+
+
+//order-1 model: the code of a byte depends on the byte before it
+//the 256 previous byte values are clustered by their statistics into at most MAX_TABLES
+//classes with one code each, the first byte of a block counts as following a 0
+//serialized as the table count (1 B), the packed context map and the packed code of every class
+class ContextModel{
+  public:
+    static const unsigned int MAX_TABLES = 64;
+    unsigned int tables = 0;
+    unsigned char contextMap[256] = {0}; //class of each previous byte value
+    std::vector<unsigned char> lengths; //code lengths of class k at k*256
+    uint64_t bits = 0; //coded size of the counted data
+    size_t headerBytes = 0; //serialized size of map and tables
+  private:
+    static const unsigned int ITERATIONS = 6;
+    std::vector<uint32_t> pairs; //pairs[previous*256 + byte]
+    std::vector<uint64_t> histograms; //per class
+    std::vector<float> costs; //bits per byte in each class
+    std::vector<unsigned char> symbols; //bytes following each previous byte value, sparse
+    std::vector<uint32_t> counts;
+    std::vector<EncodeTable> codes;
+    //total cost of the bytes following previous when coded in class k
+    float cost(unsigned int start, unsigned int end, unsigned int k) const {
+      const float* c = &costs[k*256];
+      float sum = 0;
+      for(unsigned int j=start; j<end; j++) sum += counts[j] * c[symbols[j]];
+      return sum;
+    }
+    void classHistograms(const unsigned char* used, unsigned int n){
+      histograms.assign(size_t(tables)*256, 0);
+      for(unsigned int i=0; i<n; i++){
+        uint64_t* h = &histograms[contextMap[used[i]]*256];
+        const uint32_t* f = &pairs[used[i]*256];
+        for(int c=0; c<256; c++) h[c] += f[c];
+      }
+    }
+    //bits order-1 coding could save over order-0 beyond 1/64 of the order-0 size, from the entropies
+    //of both, the order-1 one corrected for its bias (Miller-Madow), as sparse contexts look more
+    //predictable than they are
+    double entropyGain(const uint64_t totals[256], const unsigned char* used, unsigned int n, const unsigned int* offsets) const {
+      uint64_t frequencies[256] = {0};
+      uint64_t total = 0;
+      double order1 = 0;
+      for(unsigned int i=0; i<n; i++){
+        uint64_t t = totals[used[i]];
+        total += t;
+        order1 += t * std::log2(double(t)) + (offsets[i+1] - offsets[i] - 1) / (2 * std::log(2.0));
+        for(unsigned int j=offsets[i]; j<offsets[i+1]; j++){
+          order1 -= counts[j] * std::log2(double(counts[j]));
+          frequencies[symbols[j]] += counts[j];
+        }
+      }
+      if(total == 0) return -1;
+      double order0 = total * std::log2(double(total));
+      for(int c=0; c<256; c++){
+        if(frequencies[c] > 0) order0 -= frequencies[c] * std::log2(double(frequencies[c]));
+      }
+      return order0 - order1 - order0/64;
+    }
+    //renumbers the classes contexts are mapped to from 0 in their order, dropping empty ones
+    void compact(const unsigned char* used, unsigned int n){
+      bool present[MAX_TABLES] = {false};
+      for(unsigned int i=0; i<n; i++) present[contextMap[used[i]]] = true;
+      unsigned char renumber[MAX_TABLES];
+      unsigned int next = 0;
+      for(unsigned int k=0; k<tables; k++){
+        if(!present[k]) continue;
+        if(!lengths.empty() && next != k) memcpy(&lengths[next*256], &lengths[k*256], 256);
+        renumber[k] = next++;
+      }
+      for(unsigned int i=0; i<n; i++) contextMap[used[i]] = renumber[contextMap[used[i]]];
+      tables = next;
+      if(!lengths.empty()) lengths.resize(size_t(tables)*256);
+    }
+  public:
+    //counts the byte pairs of data, frequencies gets the plain byte histogram
+    void count(const unsigned char* data, size_t size, uint64_t frequencies[256]){
+      pairs.assign(256*256, 0);
+      unsigned int previous = 0;
+      for(size_t i=0; i<size; i++){
+        pairs[previous << 8 | data[i]]++;
+        previous = data[i];
+      }
+      for(int p=0; p<256; p++){
+        for(int c=0; c<256; c++) frequencies[c] += pairs[p << 8 | c];
+      }
+    }
+    //clusters the counted previous byte values into at most maxTables classes and builds their codes
+    //k-means style: the most frequent contexts seed the classes, then every context moves to the class
+    //its bytes are cheapest in, estimated from the class histograms, until nothing moves
+    //leaves tables at 0 when the data does not depend enough on the previous byte to pay for the tables
+    void build(unsigned int maxTables, unsigned int maxLength){
+      maxTables = (maxTables > MAX_TABLES ? MAX_TABLES : std::max(maxTables, 1u));
+      //contexts that occur, most frequent first, with the bytes following them
+      uint64_t totals[256] = {0};
+      unsigned char used[256];
+      unsigned int offsets[257];
+      unsigned int n = 0;
+      symbols.clear();
+      counts.clear();
+      for(int p=0; p<256; p++){
+        for(int c=0; c<256; c++) totals[p] += pairs[p << 8 | c];
+        if(totals[p] > 0) used[n++] = p;
+      }
+      std::stable_sort(used, used + n, [&](unsigned char a, unsigned char b){ return totals[a] > totals[b]; });
+      for(unsigned int i=0; i<n; i++){
+        offsets[i] = symbols.size();
+        for(int c=0; c<256; c++){
+          if(pairs[used[i] << 8 | c] == 0) continue;
+          symbols.push_back(c);
+          counts.push_back(pairs[used[i] << 8 | c]);
+        }
+      }
+      offsets[n] = symbols.size();
+      memset(contextMap, 0, 256);
+      lengths.clear();
+      tables = 0;
+      bits = 0;
+      headerBytes = 0;
+      if(this->entropyGain(totals, used, n, offsets) < 0) return;
+      tables = std::min(n, maxTables);
+      for(unsigned int i=0; i<tables; i++) contextMap[used[i]] = i;
+      for(unsigned int round=0; n > tables && round<ITERATIONS; round++){
+        //the first round only has the seeds in their classes
+        classHistograms(used, round == 0 ? tables : n);
+        costs.resize(size_t(tables)*256);
+        for(unsigned int k=0; k<tables; k++){
+          const uint64_t* h = &histograms[k*256];
+          uint64_t total = 0;
+          for(int c=0; c<256; c++) total += h[c];
+          //bytes new to a class cost about as much as the rarest ones in it
+          float base = std::log2(total + 128.0f);
+          for(int c=0; c<256; c++) costs[k*256 + c] = base - std::log2(h[c] + 0.5f);
+        }
+        bool moved = false;
+        for(unsigned int i=0; i<n; i++){
+          unsigned int best = contextMap[used[i]];
+          float bestCost = (round == 0 && i >= tables) ? INFINITY : this->cost(offsets[i], offsets[i+1], best);
+          for(unsigned int k=0; k<tables; k++){
+            float c = this->cost(offsets[i], offsets[i+1], k);
+            if(c < bestCost){
+              bestCost = c;
+              best = k;
+            }
+          }
+          if(best != contextMap[used[i]]) moved = true;
+          contextMap[used[i]] = best;
+        }
+        if(round > 0 && !moved) break;
+      }
+      this->compact(used, n);
+      //codes from the final classes, then every context moves to the class whose code is
+      //cheapest for it among those that can code all of its bytes
+      classHistograms(used, n);
+      lengths.resize(size_t(tables)*256);
+      for(unsigned int k=0; k<tables; k++) Huffman::buildCodeLengths(&histograms[k*256], maxLength, &lengths[k*256]);
+      bits = 0;
+      for(unsigned int i=0; i<n; i++){
+        unsigned int best = contextMap[used[i]];
+        uint64_t bestBits = UINT64_MAX;
+        for(unsigned int k=0; k<tables; k++){
+          const unsigned char* l = &lengths[k*256];
+          uint64_t b = 0;
+          for(unsigned int j=offsets[i]; j<offsets[i+1] && b < bestBits; j++){
+            b = (l[symbols[j]] == 0 ? UINT64_MAX : b + uint64_t(counts[j]) * l[symbols[j]]);
+          }
+          if(b < bestBits){
+            bestBits = b;
+            best = k;
+          }
+        }
+        contextMap[used[i]] = best;
+        bits += bestBits;
+      }
+      this->compact(used, n);
+      unsigned char packed[256];
+      headerBytes = 1 + Huffman::packCodeLengths(contextMap, packed);
+      codes.clear();
+      for(unsigned int k=0; k<tables; k++){
+        headerBytes += Huffman::packCodeLengths(&lengths[k*256], packed);
+        codes.emplace_back(&lengths[k*256]);
+      }
+    }
+    //writes map and tables (headerBytes) to out
+    size_t write(unsigned char* out) const {
+      size_t length = 0;
+      out[length++] = tables;
+      length += Huffman::packCodeLengths(contextMap, out + length);
+      for(unsigned int k=0; k<tables; k++) length += Huffman::packCodeLengths(&lengths[k*256], out + length);
+      return length;
+    }
+    //codes the counted data
+    void encode(const unsigned char* data, size_t size, BitWriter& writer) const {
+      const EncodeTable* byPrevious[256];
+      for(int p=0; p<256; p++) byPrevious[p] = &codes[contextMap[p]];
+      unsigned char previous = 0;
+      for(size_t i=0; i<size; i++){
+        const EncodeTable& table = *byPrevious[previous];
+        writer.put(table.code(data[i]), table.length(data[i]));
+        previous = data[i];
+      }
+    }
+    //reads map and tables written by write and builds the decode tables for them,
+    //returns the bytes read or 0 if they are malformed
+    static size_t read(const unsigned char* serial, size_t length, unsigned char contextMap[256], std::vector<DecodeTable>& tables){
+      if(length < 1 || serial[0] < 1 || serial[0] > MAX_TABLES) return 0;
+      unsigned int count = serial[0];
+      size_t pos = 1;
+      size_t packedLength = Huffman::unpackCodeLengths(serial + pos, length - pos, contextMap);
+      if(packedLength == 0) return 0;
+      pos += packedLength;
+      for(int p=0; p<256; p++){
+        if(contextMap[p] >= count) return 0;
+      }
+      if(tables.size() < count) tables.resize(count);
+      for(unsigned int k=0; k<count; k++){
+        unsigned char codeLengths[256];
+        packedLength = Huffman::unpackCodeLengths(serial + pos, length - pos, codeLengths);
+        if(packedLength == 0 || !Huffman::validCodeLengths(codeLengths)) return 0;
+        pos += packedLength;
+        tables[k].assign(EncodeTable(codeLengths), false);
+      }
+      DecodeTable::pairContexts(tables.data(), count, contextMap);
+      return pos;
+    }
+};
+
+//Burrows-Wheeler transform followed by move-to-front and zero-run coding, as in bzip2
+//sorting the rotations of a block groups bytes by the context following them, move-to-front
+//turns the resulting runs into small ranks, mostly zero, which a Huffman code takes down to a
+//few bits each
+//the inverse walks the block one cache miss per byte, so the rows of CHAINS evenly spaced
+//positions are kept and as many walks run interleaved
+class Bwt{
+  public:
+    static const unsigned int CHAINS = 4;
+    //working memory kept between blocks
+    struct Scratch{
+      std::vector<int32_t> suffixes;
+      std::vector<unsigned char> types;
+      std::vector<int32_t> buckets;
+      std::vector<unsigned char> last; //the transformed block before move-to-front
+      std::vector<uint32_t> links;
+      std::vector<uint64_t> wideLinks; //for blocks of 16 MiB and more
+    };
+  private:
+    //a block as the suffix sort sees it: bytes shifted up by one and a 0 sentinel at the end
+    struct ByteText{
+      const unsigned char* data;
+      int32_t size;
+      int32_t operator[](int32_t i) const {
+        return i < size ? int32_t(data[i]) + 1 : 0;
+      }
+    };
+    struct IntText{
+      const int32_t* data;
+      int32_t operator[](int32_t i) const {
+        return data[i];
+      }
+    };
+    template<typename Text>
+    static void buckets(const Text& s, int32_t n, int32_t k, int32_t* bucket, bool end){
+      for(int32_t i=0; i<=k; i++) bucket[i] = 0;
+      for(int32_t i=0; i<n; i++) bucket[s[i]]++;
+      int32_t sum = 0;
+      for(int32_t i=0; i<=k; i++){
+        sum += bucket[i];
+        bucket[i] = end ? sum : sum - bucket[i];
+      }
+    }
+    //places L-type suffixes from the front of their buckets, then S-type ones from the back
+    template<typename Text>
+    static void induce(const Text& s, const unsigned char* sType, int32_t* sa, int32_t n, int32_t k, int32_t* bucket){
+      buckets(s, n, k, bucket, false);
+      for(int32_t i=0; i<n; i++){
+        int32_t j = sa[i] - 1;
+        if(j >= 0 && !sType[j]) sa[bucket[s[j]]++] = j;
+      }
+      buckets(s, n, k, bucket, true);
+      for(int32_t i=n-1; i>=0; i--){
+        int32_t j = sa[i] - 1;
+        if(j >= 0 && sType[j]) sa[--bucket[s[j]]] = j;
+      }
+    }
+    //suffix array of s[0, n) by induced sorting (SA-IS, Nong, Zhang and Chan), the last symbol
+    //has to be a unique smallest 0 and all symbols at most k
+    //sType and bucket point to at least 2n and n + k + 1 entries, the recursion uses what follows its own
+    template<typename Text>
+    static void suffixArray(const Text& s, int32_t* sa, int32_t n, int32_t k, unsigned char* sType, int32_t* bucket){
+      sType[n-1] = 1;
+      if(n == 1){
+        sa[0] = 0;
+        return;
+      }
+      sType[n-2] = 0;
+      for(int32_t i=n-3; i>=0; i--) sType[i] = (s[i] < s[i+1] || (s[i] == s[i+1] && sType[i+1]));
+      auto isLms = [&](int32_t i){ return i > 0 && sType[i] && !sType[i-1]; };
+      //sort the LMS substrings
+      buckets(s, n, k, bucket, true);
+      for(int32_t i=0; i<n; i++) sa[i] = -1;
+      for(int32_t i=1; i<n; i++){
+        if(isLms(i)) sa[--bucket[s[i]]] = i;
+      }
+      induce(s, sType, sa, n, k, bucket);
+      int32_t n1 = 0;
+      for(int32_t i=0; i<n; i++){
+        if(isLms(sa[i])) sa[n1++] = sa[i];
+      }
+      //name them in order, equal substrings get the same name
+      for(int32_t i=n1; i<n; i++) sa[i] = -1;
+      int32_t names = 0;
+      int32_t previous = -1;
+      for(int32_t i=0; i<n1; i++){
+        int32_t pos = sa[i];
+        bool differs = false;
+        for(int32_t d=0; d<n; d++){
+          if(previous == -1 || s[pos+d] != s[previous+d] || sType[pos+d] != sType[previous+d]){
+            differs = true;
+            break;
+          }
+          if(d > 0 && (isLms(pos+d) || isLms(previous+d))) break;
+        }
+        if(differs){
+          names++;
+          previous = pos;
+        }
+        sa[n1 + pos/2] = names - 1;
+      }
+      for(int32_t i=n-1, j=n-1; i>=n1; i--){
+        if(sa[i] >= 0) sa[j--] = sa[i];
+      }
+      //sort the LMS suffixes by their names, recursing while names repeat
+      int32_t* sa1 = sa;
+      int32_t* s1 = sa + n - n1;
+      if(names < n1){
+        suffixArray(IntText{s1}, sa1, n1, names - 1, sType + n, bucket + k + 1);
+      }else{
+        for(int32_t i=0; i<n1; i++) sa1[s1[i]] = i;
+      }
+      //induce the order of all suffixes from the sorted LMS suffixes
+      buckets(s, n, k, bucket, true);
+      for(int32_t i=1, j=0; i<n; i++){
+        if(isLms(i)) s1[j++] = i;
+      }
+      for(int32_t i=0; i<n1; i++) sa1[i] = s1[sa1[i]];
+      for(int32_t i=n1; i<n; i++) sa[i] = -1;
+      for(int32_t i=n1-1; i>=0; i--){
+        int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--bucket[s[j]]] = j;
+      }
+      induce(s, sType, sa, n, k, bucket);
+    }
+    //writes the byte before every sorted suffix, but the sentinel's, and sets the rows the
+    //chains start from, rows[0] is the row of the whole block among them
+    static void sortRotations(const unsigned char* data, size_t size, unsigned char* out, uint32_t rows[CHAINS], Scratch& scratch){
+      int32_t n = size + 1;
+      if(scratch.suffixes.size() < size_t(n)) scratch.suffixes.resize(n);
+      if(scratch.types.size() < 2*size_t(n)) scratch.types.resize(2*size_t(n));
+      if(scratch.buckets.size() < size_t(n) + 257) scratch.buckets.resize(size_t(n) + 257);
+      int32_t* sa = scratch.suffixes.data();
+      Bwt::suffixArray(ByteText{data, int32_t(size)}, sa, n, 256, scratch.types.data(), scratch.buckets.data());
+      size_t chain = size / CHAINS;
+      size_t j = 0;
+      for(int32_t i=0; i<n; i++){
+        size_t pos = sa[i];
+        if(pos == 0){
+          rows[0] = i;
+        }else{
+          out[j++] = data[pos - 1];
+          if(chain > 0 && pos % chain == 0 && pos / chain < CHAINS) rows[pos / chain] = i;
+        }
+      }
+      if(chain == 0){
+        for(unsigned int k=1; k<CHAINS; k++) rows[k] = rows[0];
+      }
+    }
+    //walks the rows back into the original order, a link holds the next row above the byte
+    template<typename Link>
+    static void unsort(const unsigned char* last, size_t size, const uint32_t rows[CHAINS], unsigned char* out, Link* links){
+      uint32_t primary = rows[0];
+      size_t counts[256] = {0};
+      for(size_t i=0; i<size; i++) counts[last[i]]++;
+      //first row of every byte, row 0 is the sentinel's
+      size_t next[256];
+      size_t sum = 1;
+      for(int c=0; c<256; c++){
+        next[c] = sum;
+        sum += counts[c];
+      }
+      links[0] = Link(primary) << 8;
+      for(size_t i=0; i<=size; i++){
+        if(i == primary) continue;
+        unsigned char c = last[i - (i > primary)];
+        links[next[c]++] = (Link(i) << 8) | c;
+      }
+      size_t chain = size / CHAINS;
+      Link row[CHAINS];
+      for(unsigned int k=0; k<CHAINS; k++) row[k] = rows[k];
+      for(size_t i=0; i<chain; i++){
+        for(unsigned int k=0; k<CHAINS; k++){
+          Link v = links[row[k]];
+          out[k*chain + i] = v & 0xFF;
+          row[k] = v >> 8;
+        }
+      }
+      //the last chain runs to the end
+      for(size_t i=CHAINS*chain; i<size; i++){
+        Link v = links[row[CHAINS-1]];
+        out[i] = v & 0xFF;
+        row[CHAINS-1] = v >> 8;
+      }
+    }
+    //runs of rank 0 in bijective base 2 with digits 0 and 1
+    static size_t writeRun(uint64_t run, unsigned char* out, size_t pos){
+      while(run > 0){
+        if(run & 1){
+          out[pos++] = 0;
+          run = (run - 1) >> 1;
+        }else{
+          out[pos++] = 1;
+          run = (run - 2) >> 1;
+        }
+      }
+      return pos;
+    }
+  public:
+    //transformed data needs at most this much room
+    static size_t bound(size_t size){
+      return 2*size;
+    }
+    //transforms data into out, which needs bound(size) bytes, and returns the length written
+    //rows are needed to invert it
+    //move-to-front ranks are written as rank + 1 up to rank 253, ranks 254 and 255 as 255
+    //followed by rank - 254, runs of rank 0 take bytes 0 and 1
+    static size_t forward(const unsigned char* data, size_t size, unsigned char* out, uint32_t rows[CHAINS], Scratch& scratch){
+      if(scratch.last.size() < size) scratch.last.resize(size);
+      const unsigned char* last = scratch.last.data();
+      Bwt::sortRotations(data, size, scratch.last.data(), rows, scratch);
+      unsigned char order[256];
+      for(int c=0; c<256; c++) order[c] = c;
+      size_t pos = 0;
+      uint64_t run = 0;
+      for(size_t i=0; i<size; i++){
+        unsigned char c = last[i];
+        if(order[0] == c){
+          run++;
+          continue;
+        }
+        pos = Bwt::writeRun(run, out, pos);
+        run = 0;
+        unsigned int rank = 1;
+        while(order[rank] != c) rank++;
+        memmove(order + 1, order, rank);
+        order[0] = c;
+        if(rank < 254){
+          out[pos++] = rank + 1;
+        }else{
+          out[pos++] = 255;
+          out[pos++] = rank - 254;
+        }
+      }
+      return Bwt::writeRun(run, out, pos);
+    }
+    //restores size bytes into out, false if the transformed data is malformed
+    static bool inverse(const unsigned char* in, size_t inSize, const uint32_t rows[CHAINS], unsigned char* out, size_t size, Scratch& scratch){
+      for(unsigned int k=0; k<CHAINS; k++){
+        if(rows[k] > size) return false;
+      }
+      if(scratch.last.size() < size) scratch.last.resize(size);
+      unsigned char* last = scratch.last.data();
+      unsigned char order[256];
+      for(int c=0; c<256; c++) order[c] = c;
+      size_t pos = 0;
+      uint64_t run = 0;
+      unsigned int digit = 0;
+      for(size_t i=0; i<=inSize; i++){
+        unsigned int b = (i < inSize ? in[i] : 2);
+        if(b <= 1){
+          if(digit >= 40) return false;
+          run += uint64_t(b + 1) << digit++;
+          continue;
+        }
+        if(run > size - pos) return false;
+        memset(last + pos, order[0], run);
+        pos += run;
+        run = 0;
+        digit = 0;
+        if(i == inSize) break;
+        unsigned int rank = b - 1;
+        if(b == 255){
+          if(++i >= inSize || in[i] > 1) return false;
+          rank = 254 + in[i];
+        }
+        if(pos >= size) return false;
+        unsigned char c = order[rank];
+        memmove(order + 1, order, rank);
+        order[0] = c;
+        last[pos++] = c;
+      }
+      if(pos != size) return false;
+      if(size + 1 < (size_t(1) << 24)){
+        if(scratch.links.size() < size + 1) scratch.links.resize(size + 1);
+        Bwt::unsort(last, size, rows, out, scratch.links.data());
+      }else{
+        if(scratch.wideLinks.size() < size + 1) scratch.wideLinks.resize(size + 1);
+        Bwt::unsort(last, size, rows, out, scratch.wideLinks.data());
+      }
+      return true;
+    }
+};
+
+//format version 3: the input is cut into fixed-size blocks that decode independently
+//header: magic, version, flags, block size (4 B), shared code lengths if FLAG_SHARED_TABLE
+//block: type (1 B), raw size (4 B), payload size (4 B), payload, CRC32C of the raw bytes (4 B)
+//if FLAG_CHECKSUMS
+//after the last block: BLOCK_END (1 B)
+//index: per block its archive offset (8 B), raw size (4 B) and payload size (4 B)
+//footer: index offset (8 B), block count (4 B), reversed magic
+//all integers are little endian
+//archives are written and read as streams holding only a batch of blocks in memory,
+//the index is only needed to seek to a byte range
+class BlockArchive{
+  public:
+    static const uint32_t DEFAULT_BLOCK_SIZE = 1 << 20;
+    static const unsigned char FLAG_SHARED_TABLE = 0x01;
+    static const unsigned char FLAG_STREAMS_SHIFT = 1; //bits 1-3: interleaved streams per block - 1
+    static const unsigned char FLAG_STREAMS_MASK = 0x0E;
+    static const unsigned char FLAG_TRANSFORM_SHIFT = 4; //bits 4-5: transform of the coded blocks
+    static const unsigned char FLAG_TRANSFORM_MASK = 0x30;
+    static const unsigned char FLAG_DIRECTORY = 0x40; //batch archive: the data are files back to back, a directory lists them
+    static const unsigned char FLAG_CHECKSUMS = 0x80; //every block ends in the CRC32C of its raw bytes
+    static const unsigned int TRANSFORM_NONE = 0;
+    static const unsigned int TRANSFORM_BWT = 1; //see Bwt
+    static const unsigned int MAX_STREAMS = DecodeTable::MAX_STREAMS;
+    static const unsigned char BLOCK_OWN_TABLE = 0x00; //payload: packed code lengths, data
+    static const unsigned char BLOCK_SHARED_TABLE = 0x01; //payload: data
+    static const unsigned char BLOCK_STORED = 0x02; //payload: the raw bytes
+    static const unsigned char BLOCK_REUSED_TABLE = 0x03; //payload: index of an earlier block with its own table, data
+    static const unsigned char BLOCK_CONTEXT = 0x04; //payload: context model (see ContextModel), data in one stream
+    static const unsigned char BLOCK_END = 0xFF; //no payload, the index follows
+    static const size_t HEADER_SIZE = 8;
+    static const size_t MAX_PACKED_TABLE_SIZE = 256; //every token covers at least one value
+    static const size_t BLOCK_HEADER_SIZE = 9;
+    static const size_t CHECKSUM_SIZE = 4;
+    static const size_t INDEX_ENTRY_SIZE = 16;
+    static const size_t FOOTER_SIZE = 14;
+    static const size_t STREAM_SIZE_BYTES = 4;
+    static const size_t TABLE_REFERENCE_SIZE = 4;
+    static const size_t TRANSFORM_HEADER_SIZE = 4 + 4*Bwt::CHAINS; //transformed size (4 B), BWT start rows (4 B each)
+    static const size_t WRITER_SLACK = 8; //bit writers store whole words, up to 8 bytes past their end
+    static const size_t DIRECTORY_ENTRY_SIZE = 24;
+    static const size_t DIRECTORY_TRAILER_SIZE = 12;
+    //how blocks are coded
+    struct Settings{
+      uint32_t blockSize = DEFAULT_BLOCK_SIZE;
+      unsigned int maxCodeLength = 0;
+      const unsigned char* sharedLengths = NULL; //code lengths of a table for all blocks, null for a table per block
+      unsigned int streams = 1; //symbols of a block are dealt round-robin to this many bit streams
+      unsigned int contextTables = 0; //order-1 context blocks with up to this many tables where they pay, 0 for none
+      unsigned int transform = TRANSFORM_NONE; //applied to every block before it is counted and coded
+      bool batch = false; //FLAG_DIRECTORY, blocks then take their own table where it beats sharedLengths
+      bool checksums = true; //FLAG_CHECKSUMS
+      Stats* stats = NULL; //counters to add to, optional
+    };
+    //how a block is going to be coded, decided from its histogram before anything is coded
+    struct BlockPlan{
+      uint64_t frequencies[256];
+      unsigned char lengths[256]; //code lengths the block is coded with
+      unsigned char type;
+      uint32_t tableBlock; //for BLOCK_REUSED_TABLE
+      ContextModel context; //if settings.contextTables is set
+      std::vector<unsigned char> transformed; //the block after settings.transform, kept for its capacity
+      size_t transformedSize;
+      uint32_t rows[Bwt::CHAINS]; //for TRANSFORM_BWT
+    };
+    //plans of a batch and the table later blocks may reuse, carried from batch to batch of one archive
+    struct EncodeState{
+      std::vector<BlockPlan> plans;
+      bool hasTable = false;
+      uint32_t tableBlock = 0; //last block with its own table
+      unsigned char tableLengths[256];
+      std::vector<Bwt::Scratch> transforms; //per thread
+    };
+    //what a worker rebuilds per block, kept so its memory is reused
+    struct BlockScratch{
+      DecodeTable own; //for blocks with their own or a reused table
+      std::vector<DecodeTable> contexts;
+      std::vector<unsigned char> transformed; //coded data decoded ahead of the inverse transform
+      Bwt::Scratch bwt;
+    };
+    struct Block{
+      uint64_t offset; //of the block header within the archive
+      uint64_t rawOffset; //of the block data within the original file
+      uint32_t rawSize;
+      uint32_t payloadSize;
+    };
+    struct Info{
+      unsigned char flags = 0;
+      uint32_t blockSize = 0;
+      size_t headerLength = 0;
+      unsigned char sharedLengths[256] = {0}; //if FLAG_SHARED_TABLE
+      std::vector<Block> blocks;
+      uint64_t rawSize = 0;
+      uint64_t indexOffset = 0;
+      uint64_t blockCount = 0; //in the archive, blocks may only hold some of them
+      uint64_t firstBlock = 0; //index of blocks[0] in the archive
+      unsigned int streams() const {
+        return ((flags & FLAG_STREAMS_MASK) >> FLAG_STREAMS_SHIFT) + 1;
+      }
+      unsigned int transform() const {
+        return (flags & FLAG_TRANSFORM_MASK) >> FLAG_TRANSFORM_SHIFT;
+      }
+      size_t blockLength(const Block& b) const {
+        return BlockArchive::blockLength(b.payloadSize, flags);
+      }
+    };
+    //a file in a batch archive, the raw bytes [rawOffset, rawOffset+rawSize) of the archive
+    struct Member{
+      std::string name;
+      uint64_t rawOffset;
+      uint64_t rawSize;
+    };
+    //the directory of a batch archive as it lies in memory, entries are sorted by name
+    struct Directory{
+      const unsigned char* entries = NULL;
+      const unsigned char* names = NULL;
+      uint64_t namesLength = 0;
+      uint32_t count = 0;
+    };
+  private:
+    static void setUint(unsigned char* out, uint64_t value, int bytes){
+      for(int i=0; i<bytes; i++) out[i] = (value >> (8*i)) & 0xFF;
+    }
+    static uint64_t getUint(const unsigned char* in, int bytes){
+      uint64_t v = 0;
+      for(int i=0; i<bytes; i++) v |= uint64_t(in[i]) << (8*i);
+      return v;
+    }
+    //codes the data of a block into out, returns the bytes used
+    static size_t encodeData(const unsigned char* data, size_t size, const EncodeTable& table, const uint64_t frequencies[256], unsigned int streams, unsigned char* out){
+      uint64_t bits = table.encodedBits(frequencies);
+      if(streams <= 1){
+        BitWriter writer(out);
+        if(bits > 0) table.encode(data, size, writer);
+        return writer.finish();
+      }
+      //sizes of all streams but the last, then the streams back to back
+      //they are written one after the other so each writer's slack only lands on the next stream's space
+      unsigned char* pos = out + (streams - 1)*STREAM_SIZE_BYTES;
+      for(unsigned int k=0; k<streams; k++){
+        BitWriter writer(pos);
+        if(bits > 0 && k < size) table.encodeStrided(data + k, size - k, streams, writer);
+        size_t length = writer.finish();
+        if(k + 1 < streams) setUint(out + k*STREAM_SIZE_BYTES, length, STREAM_SIZE_BYTES);
+        pos += length;
+      }
+      return pos - out;
+    }
+    //decodes count symbols of data coded by encodeData
+    static bool decodeData(const DecodeTable& table, const unsigned char* data, size_t size, unsigned int streams, char* out, size_t count){
+      if(streams > 1){
+        const unsigned char* streamData[MAX_STREAMS];
+        size_t streamSizes[MAX_STREAMS];
+        size_t sizesLength = (streams - 1)*STREAM_SIZE_BYTES;
+        if(streams > MAX_STREAMS || size < sizesLength) return false;
+        const unsigned char* pos = data + sizesLength;
+        size_t left = size - sizesLength;
+        for(unsigned int k=0; k<streams; k++){
+          size_t length = (k + 1 < streams ? getUint(data + k*STREAM_SIZE_BYTES, STREAM_SIZE_BYTES) : left);
+          if(length > left) return false;
+          streamData[k] = pos;
+          streamSizes[k] = length;
+          pos += length;
+          left -= length;
+        }
+        return table.decodeInterleaved(streamData, streamSizes, streams, out, count);
+      }
+      size_t written = 0;
+      uint64_t bitPos = 0;
+      table.decode(data, size, uint64_t(size)*8, out, count, written, bitPos);
+      return written == count;
+    }
+    //reads up to size bytes, fewer only at the end of the stream
+    static size_t readFully(std::istream& in, unsigned char* buffer, size_t size, Stats* stats = NULL){
+      Stats::Timer timer(stats, Stats::READ);
+      in.read((char*)buffer, size);
+      return in.gcount();
+    }
+  public:
+    static bool isArchive(const unsigned char* serial, size_t length){
+      return length >= 3 && serial[0] == 0xAD && serial[1] == 0xBD && serial[2] == 0x03;
+    }
+
+    //header flags of archives written with these settings
+    static unsigned char flags(const Settings& settings){
+      unsigned char flags = (settings.sharedLengths ? FLAG_SHARED_TABLE : 0);
+      flags |= ((settings.streams - 1) << FLAG_STREAMS_SHIFT) & FLAG_STREAMS_MASK;
+      flags |= (settings.transform << FLAG_TRANSFORM_SHIFT) & FLAG_TRANSFORM_MASK;
+      if(settings.batch) flags |= FLAG_DIRECTORY;
+      if(settings.checksums) flags |= FLAG_CHECKSUMS;
+      return flags;
+    }
+    //bytes a block takes in an archive with these flags
+    static size_t blockLength(uint32_t payloadSize, unsigned char flags){
+      return BLOCK_HEADER_SIZE + payloadSize + ((flags & FLAG_CHECKSUMS) ? CHECKSUM_SIZE : 0);
+    }
+
+    //writes the header to out, which needs HEADER_SIZE + MAX_PACKED_TABLE_SIZE bytes, returns its length
+    static size_t header(const Settings& settings, unsigned char* out){
+      out[0] = 0xAD; //header part 1
+      out[1] = 0xBD; //header part 2
+      out[2] = 0x03; //version 3
+      out[3] = BlockArchive::flags(settings);
+      setUint(out + 4, settings.blockSize, 4);
+      size_t length = HEADER_SIZE;
+      if(settings.sharedLengths) length += Huffman::packCodeLengths(settings.sharedLengths, out + length);
+      return length;
+    }
+    static std::string header(const Settings& settings){
+      unsigned char head[HEADER_SIZE + MAX_PACKED_TABLE_SIZE];
+      return std::string((const char*)head, BlockArchive::header(settings, head));
+    }
+
+    //parses a header from its first bytes, false if malformed or if more bytes are needed
+    static bool parseHeader(const unsigned char* serial, size_t length, Info& info){
+      if(length < HEADER_SIZE || !BlockArchive::isArchive(serial, length)) return false;
+      info.flags = serial[3];
+      if(info.transform() > TRANSFORM_BWT) return false;
+      info.blockSize = getUint(serial + 4, 4);
+      info.headerLength = HEADER_SIZE;
+      if(info.flags & FLAG_SHARED_TABLE){
+        unsigned char codeLengths[256] = {0};
+        size_t packedLength = Huffman::unpackCodeLengths(serial + HEADER_SIZE, length - HEADER_SIZE, codeLengths);
+        if(packedLength == 0 || !Huffman::validCodeLengths(codeLengths)) return false;
+        memcpy(info.sharedLengths, codeLengths, 256);
+        info.headerLength += packedLength;
+      }
+      return true;
+    }
+
+    //largest coded size of a block of size bytes, including the slack the bit writers need
+    //a block is only coded if that makes it smaller, otherwise it is stored
+    static size_t blockBound(size_t size){
+      return BLOCK_HEADER_SIZE + size + CHECKSUM_SIZE + WRITER_SLACK;
+    }
+
+    //upper bound of the bytes encodeData writes for the given frequencies, SIZE_MAX if
+    //a symbol has no code
+    static size_t codedBound(const uint64_t frequencies[256], const unsigned char codeLengths[256], unsigned int streams){
+      uint64_t bits = 0;
+      for(int c=0; c<256; c++){
+        if(frequencies[c] == 0) continue;
+        if(codeLengths[c] == 0) return SIZE_MAX;
+        bits += frequencies[c] * codeLengths[c];
+      }
+      //each stream rounds up to whole bytes
+      return (streams - 1)*STREAM_SIZE_BYTES + bits/8 + streams;
+    }
+
+    //transforms a block if the settings ask for it, counts it and builds its own code lengths
+    //unless there is a shared table, and its context model if context blocks are enabled
+    static void planBlock(const unsigned char* data, size_t size, const Settings& settings, BlockPlan& plan, Bwt::Scratch& scratch){
+      if(settings.transform == TRANSFORM_BWT){
+        Stats::Timer timer(settings.stats, Stats::TRANSFORM);
+        if(plan.transformed.size() < Bwt::bound(size)) plan.transformed.resize(Bwt::bound(size));
+        plan.transformedSize = Bwt::forward(data, size, plan.transformed.data(), plan.rows, scratch);
+        data = plan.transformed.data();
+        size = plan.transformedSize;
+      }
+      memset(plan.frequencies, 0, sizeof(plan.frequencies));
+      {
+        Stats::Timer timer(settings.stats, Stats::HISTOGRAM);
+        if(settings.contextTables > 1){
+          plan.context.count(data, size, plan.frequencies);
+        }else{
+          Histogram::count(data, size, plan.frequencies);
+        }
+      }
+      Stats::Timer timer(settings.stats, Stats::BUILD);
+      if(!settings.sharedLengths || settings.batch) Huffman::buildCodeLengths(plan.frequencies, settings.maxCodeLength, plan.lengths);
+      if(settings.contextTables > 1) plan.context.build(settings.contextTables, settings.maxCodeLength);
+    }
+
+    //picks the smallest way to code a planned block: the shared table, its own table, the table
+    //of the last block that had one or its context model, and stores the block when none of them
+    //makes it smaller, size is the raw size of the block
+    //blocks have to be chosen in order, index is the block's position in the archive
+    static void chooseTable(size_t size, const Settings& settings, BlockPlan& plan, EncodeState& state, uint32_t index){
+      size_t best = SIZE_MAX;
+      if(!settings.sharedLengths || settings.batch){
+        unsigned char packed[MAX_PACKED_TABLE_SIZE];
+        plan.type = BLOCK_OWN_TABLE;
+        best = Huffman::packCodeLengths(plan.lengths, packed) + codedBound(plan.frequencies, plan.lengths, settings.streams);
+        size_t reused = (state.hasTable ? codedBound(plan.frequencies, state.tableLengths, settings.streams) : SIZE_MAX);
+        if(reused != SIZE_MAX && TABLE_REFERENCE_SIZE + reused <= best){
+          plan.type = BLOCK_REUSED_TABLE;
+          plan.tableBlock = state.tableBlock;
+          memcpy(plan.lengths, state.tableLengths, 256);
+          best = TABLE_REFERENCE_SIZE + reused;
+        }
+      }
+      //the shared table costs nothing per block, in batch archives it competes with the others
+      size_t shared = (settings.sharedLengths ? codedBound(plan.frequencies, settings.sharedLengths, settings.streams) : SIZE_MAX);
+      if(shared != SIZE_MAX && shared <= best){
+        plan.type = BLOCK_SHARED_TABLE;
+        memcpy(plan.lengths, settings.sharedLengths, 256);
+        best = shared;
+      }
+      if(settings.contextTables > 1 && plan.context.tables > 0){
+        size_t contextBytes = plan.context.headerBytes + plan.context.bits/8 + 1;
+        if(contextBytes < best){
+          plan.type = BLOCK_CONTEXT;
+          best = contextBytes;
+        }
+      }
+      if(settings.transform != TRANSFORM_NONE && best != SIZE_MAX) best += TRANSFORM_HEADER_SIZE;
+      if(best >= size){
+        plan.type = BLOCK_STORED;
+      }else if(plan.type == BLOCK_OWN_TABLE){
+        state.hasTable = true;
+        state.tableBlock = index;
+        memcpy(state.tableLengths, plan.lengths, 256);
+      }
+    }
+
+    //codes a planned block into out, which needs blockBound(size) bytes, and returns its length
+    //with the checksum, if settings.checksums
+    static size_t writeBlock(const unsigned char* data, size_t size, const Settings& settings, const BlockPlan& plan, unsigned char* out){
+      Stats* stats = settings.stats;
+      out[0] = plan.type;
+      setUint(out + 1, size, 4);
+      size_t length = BLOCK_HEADER_SIZE;
+      uint64_t codedBits = uint64_t(size)*8;
+      if(plan.type == BLOCK_STORED){
+        Stats::Timer timer(stats, Stats::CODE);
+        memcpy(out + length, data, size);
+        length += size;
+      }else{
+        if(plan.type == BLOCK_CONTEXT) length += plan.context.write(out + length);
+        if(plan.type == BLOCK_OWN_TABLE) length += Huffman::packCodeLengths(plan.lengths, out + length);
+        if(plan.type == BLOCK_REUSED_TABLE){
+          setUint(out + length, plan.tableBlock, TABLE_REFERENCE_SIZE);
+          length += TABLE_REFERENCE_SIZE;
+        }
+        //what gets coded, the transformed block follows its header
+        const unsigned char* symbols = data;
+        size_t count = size;
+        if(settings.transform != TRANSFORM_NONE){
+          setUint(out + length, plan.transformedSize, 4);
+          for(unsigned int k=0; k<Bwt::CHAINS; k++) setUint(out + length + 4 + 4*k, plan.rows[k], 4);
+          length += TRANSFORM_HEADER_SIZE;
+          symbols = plan.transformed.data();
+          count = plan.transformedSize;
+        }
+        if(plan.type == BLOCK_CONTEXT){
+          Stats::Timer timer(stats, Stats::CODE);
+          BitWriter writer(out + length);
+          plan.context.encode(symbols, count, writer);
+          length += writer.finish();
+          codedBits = plan.context.bits;
+        }else{
+          Stats::Timer buildTimer(stats, Stats::BUILD);
+          EncodeTable table(plan.lengths);
+          buildTimer.stop();
+          Stats::Timer timer(stats, Stats::CODE);
+          length += encodeData(symbols, count, table, plan.frequencies, settings.streams, out + length);
+          codedBits = table.encodedBits(plan.frequencies);
+        }
+      }
+      setUint(out + 5, length - BLOCK_HEADER_SIZE, 4);
+      if(settings.checksums){
+        Stats::Timer timer(stats, Stats::CHECKSUM);
+        setUint(out + length, Crc32c::compute(data, size), CHECKSUM_SIZE);
+        length += CHECKSUM_SIZE;
+      }
+      if(stats){
+        stats->symbols += size;
+        stats->codedBits += codedBits;
+        stats->blocks++;
+        if(plan.type == BLOCK_STORED) stats->storedBlocks++;
+        if(plan.type == BLOCK_REUSED_TABLE) stats->reusedTables++;
+        if(plan.type == BLOCK_CONTEXT) stats->contextBlocks++;
+      }
+      return length;
+    }
+
+    //raw size of a block given by its header, 0 if the header is incomplete
+    static uint32_t blockRawSize(const unsigned char* block, size_t size){
+      if(size < BLOCK_HEADER_SIZE) return 0;
+      return getUint(block + 1, 4);
+    }
+
+    //index of the earlier block whose table a block reuses, false for blocks of any other type
+    static bool reusedTable(const unsigned char* block, size_t size, uint32_t& tableBlock){
+      if(size < BLOCK_HEADER_SIZE + TABLE_REFERENCE_SIZE || block[0] != BLOCK_REUSED_TABLE) return false;
+      tableBlock = getUint(block + BLOCK_HEADER_SIZE, TABLE_REFERENCE_SIZE);
+      return true;
+    }
+    //how many leading bytes of a block hold its table, enough to pass on as a tableBlock
+    static size_t tablePrefix(size_t blockLength){
+      return std::min(blockLength, BLOCK_HEADER_SIZE + MAX_PACKED_TABLE_SIZE);
+    }
+    //unpacks the code lengths of a block with its own table, size may end after the table,
+    //returns the bytes of the packed table or 0 if there is none or it is malformed
+    static size_t blockTable(const unsigned char* block, size_t size, unsigned char codeLengths[256]){
+      if(size < BLOCK_HEADER_SIZE || block[0] != BLOCK_OWN_TABLE) return 0;
+      size_t payloadSize = std::min<size_t>(getUint(block + 5, 4), size - BLOCK_HEADER_SIZE);
+      memset(codeLengths, 0, 256);
+      size_t packedLength = Huffman::unpackCodeLengths(block + BLOCK_HEADER_SIZE, payloadSize, codeLengths);
+      if(packedLength == 0 || !Huffman::validCodeLengths(codeLengths)) return 0;
+      return packedLength;
+    }
+
+    //decodes a block given as its header followed by the payload and checksum into out, which has
+    //room for exactly its raw size, sharedTable has to be given for archives with a shared table
+    //and tableBlock (at least its tablePrefix) for blocks reusing the table of an earlier one,
+    //flags are the archive's (Info::flags), with FLAG_CHECKSUMS false if the output does not match
+    //scratch is rebuilt as needed, so it can be reused between blocks
+    static bool decodeBlock(const unsigned char* block, size_t size, const DecodeTable* sharedTable, const unsigned char* tableBlock, size_t tableBlockSize, unsigned char flags, BlockScratch& scratch, char* out, size_t outSize, Stats* stats = NULL){
+      if(!BlockArchive::decodePayload(block, size, sharedTable, tableBlock, tableBlockSize, flags, scratch, out, outSize, stats)) return false;
+      if(!(flags & FLAG_CHECKSUMS)) return true;
+      uint32_t payloadSize = getUint(block + 5, 4);
+      if(size < BLOCK_HEADER_SIZE + payloadSize + CHECKSUM_SIZE) return false;
+      Stats::Timer timer(stats, Stats::CHECKSUM);
+      return Crc32c::compute((const unsigned char*)out, outSize) == getUint(block + BLOCK_HEADER_SIZE + payloadSize, CHECKSUM_SIZE);
+    }
+    //decodeBlock without the checksum
+    static bool decodePayload(const unsigned char* block, size_t size, const DecodeTable* sharedTable, const unsigned char* tableBlock, size_t tableBlockSize, unsigned char flags, BlockScratch& scratch, char* out, size_t outSize, Stats* stats){
+      if(size < BLOCK_HEADER_SIZE) return false;
+      unsigned char type = block[0];
+      uint32_t rawSize = getUint(block + 1, 4);
+      uint32_t payloadSize = getUint(block + 5, 4);
+      if(size < BLOCK_HEADER_SIZE + payloadSize || rawSize != outSize) return false;
+      const unsigned char* payload = block + BLOCK_HEADER_SIZE;
+      const DecodeTable* table = sharedTable;
+      if(type == BLOCK_STORED){
+        if(payloadSize != rawSize) return false;
+        Stats::Timer timer(stats, Stats::CODE);
+        memcpy(out, payload, rawSize);
+        if(stats){
+          stats->symbols += rawSize;
+          stats->codedBits += uint64_t(rawSize)*8;
+          stats->blocks++;
+          stats->storedBlocks++;
+        }
+        return true;
+      }
+      unsigned char contextMap[256];
+      if(type == BLOCK_CONTEXT){
+        Stats::Timer timer(stats, Stats::BUILD);
+        size_t modelLength = ContextModel::read(payload, payloadSize, contextMap, scratch.contexts);
+        if(modelLength == 0) return false;
+        payload += modelLength;
+        payloadSize -= modelLength;
+        if(stats) stats->contextBlocks++;
+      }else if(type == BLOCK_OWN_TABLE || type == BLOCK_REUSED_TABLE){
+        Stats::Timer timer(stats, Stats::BUILD);
+        unsigned char codeLengths[256];
+        if(type == BLOCK_OWN_TABLE){
+          size_t packedLength = BlockArchive::blockTable(block, size, codeLengths);
+          if(packedLength == 0) return false;
+          payload += packedLength;
+          payloadSize -= packedLength;
+        }else{
+          if(tableBlock == NULL || payloadSize < TABLE_REFERENCE_SIZE || BlockArchive::blockTable(tableBlock, tableBlockSize, codeLengths) == 0) return false;
+          payload += TABLE_REFERENCE_SIZE;
+          payloadSize -= TABLE_REFERENCE_SIZE;
+          if(stats) stats->reusedTables++;
+        }
+        scratch.own.assign(EncodeTable(codeLengths));
+        table = &scratch.own;
+      }else if(type != BLOCK_SHARED_TABLE || table == NULL){
+        return false;
+      }
+      //a transformed block is decoded into scratch and inverted from there
+      unsigned int transform = (flags & FLAG_TRANSFORM_MASK) >> FLAG_TRANSFORM_SHIFT;
+      char* symbols = out;
+      size_t count = rawSize;
+      uint32_t rows[Bwt::CHAINS];
+      if(transform != TRANSFORM_NONE){
+        if(transform != TRANSFORM_BWT || payloadSize < TRANSFORM_HEADER_SIZE) return false;
+        count = getUint(payload, 4);
+        for(unsigned int k=0; k<Bwt::CHAINS; k++) rows[k] = getUint(payload + 4 + 4*k, 4);
+        if(count > Bwt::bound(rawSize)) return false;
+        payload += TRANSFORM_HEADER_SIZE;
+        payloadSize -= TRANSFORM_HEADER_SIZE;
+        if(scratch.transformed.size() < count) scratch.transformed.resize(count);
+        symbols = (char*)scratch.transformed.data();
+      }
+      if(stats){
+        stats->symbols += rawSize;
+        stats->codedBits += uint64_t(payloadSize)*8;
+        stats->blocks++;
+      }
+      {
+        Stats::Timer timer(stats, Stats::CODE);
+        bool decoded;
+        if(type == BLOCK_CONTEXT){
+          decoded = DecodeTable::decodeContexts(scratch.contexts.data(), contextMap, payload, payloadSize, symbols, count);
+        }else{
+          unsigned int streams = ((flags & FLAG_STREAMS_MASK) >> FLAG_STREAMS_SHIFT) + 1;
+          decoded = BlockArchive::decodeData(*table, payload, payloadSize, streams, symbols, count);
+        }
+        if(!decoded) return false;
+      }
+      if(transform == TRANSFORM_NONE) return true;
+      Stats::Timer timer(stats, Stats::TRANSFORM);
+      return Bwt::inverse(scratch.transformed.data(), count, rows, (unsigned char*)out, rawSize, scratch.bwt);
+    }
+
+    //decodes a block into a string holding just that block
+    static bool decodeBlock(const unsigned char* block, size_t size, const DecodeTable* sharedTable, const std::string& tableBlock, unsigned char flags, BlockScratch& scratch, std::string& out, Stats* stats = NULL){
+      out.resize(BlockArchive::blockRawSize(block, size));
+      const unsigned char* table = tableBlock.empty() ? NULL : (const unsigned char*)tableBlock.data();
+      return BlockArchive::decodeBlock(block, size, sharedTable, table, tableBlock.length(), flags, scratch, &out[0], out.size(), stats);
+    }
+
+    //byte histogram of a whole stream for the shared table, only every stride-th block
+    //is counted when stride > 1 (see Histogram::countSampled)
+    static void histogram(std::istream& in, uint32_t blockSize, unsigned int stride, uint64_t frequencies[256], ThreadPool& pool){
+      if(stride > 1){
+        std::vector<unsigned char> buffer(blockSize);
+        while(true){
+          size_t length = readFully(in, buffer.data(), buffer.size());
+          if(length == 0) break;
+          Histogram::count(buffer.data(), length, frequencies);
+          in.seekg(uint64_t(stride - 1) * blockSize, std::ios::cur);
+          if(!in) break;
+        }
+        for(int c=0; c<256; c++) frequencies[c] = std::max<uint64_t>(frequencies[c], 1);
+        return;
+      }
+      std::vector<unsigned char> buffer(size_t(blockSize) * pool.size());
+      while(true){
+        size_t length = readFully(in, buffer.data(), buffer.size());
+        if(length == 0) break;
+        Histogram::count(buffer.data(), length, frequencies, pool);
+      }
+    }
+
+    //codes the blocks of data into slots of blockBound bytes each and appends them to blocks
+    //with their offsets still unset, the blocks are planned and written in parallel on the pool
+    //if one is given, in between their tables are chosen in order
+    //state carries over between the batches of one archive and has to be fresh for the next
+    static void encodeBlocks(const unsigned char* data, size_t length, const Settings& settings, ThreadPool* pool, unsigned char* slots, std::vector<Block>& blocks, EncodeState& state){
+      uint32_t blockSize = settings.blockSize;
+      size_t slotSize = BlockArchive::blockBound(blockSize);
+      size_t count = (length + blockSize - 1) / blockSize;
+      size_t first = blocks.size();
+      uint64_t rawOffset = blocks.empty() ? 0 : blocks.back().rawOffset + blocks.back().rawSize;
+      unsigned char flags = BlockArchive::flags(settings);
+      blocks.resize(first + count);
+      if(state.plans.size() < count) state.plans.resize(count);
+      state.transforms.resize(pool ? pool->size() : 1); //left empty without a transform
+      auto plan = [&](size_t i, unsigned int worker){
+        size_t pos = i * blockSize;
+        Block& b = blocks[first + i];
+        b.offset = 0;
+        b.rawOffset = rawOffset + pos;
+        b.rawSize = std::min<size_t>(blockSize, length - pos);
+        BlockArchive::planBlock(data + pos, b.rawSize, settings, state.plans[i], state.transforms[worker]);
+      };
+      auto write = [&](size_t i){
+        Block& b = blocks[first + i];
+        b.payloadSize = BlockArchive::writeBlock(data + i*blockSize, b.rawSize, settings, state.plans[i], slots + i*slotSize) - BlockArchive::blockLength(0, flags);
+      };
+      if(pool){
+        pool->forEach(count, plan);
+      }else{
+        for(size_t i=0; i<count; i++) plan(i, 0);
+      }
+      for(size_t i=0; i<count; i++) BlockArchive::chooseTable(blocks[first + i].rawSize, settings, state.plans[i], state, first + i);
+      if(pool){
+        pool->forEach(count, write);
+      }else{
+        for(size_t i=0; i<count; i++) write(i);
+      }
+    }
+
+    //codes a batch of consecutive blocks on the pool and writes them in order
+    //slots and state are kept between batches
+    static void writeBatch(const unsigned char* data, size_t length, std::ostream& out, const Settings& settings, ThreadPool& pool, std::vector<unsigned char>& slots, EncodeState& state, std::vector<Block>& blocks, uint64_t& offset){
+      size_t slotSize = BlockArchive::blockBound(settings.blockSize);
+      size_t first = blocks.size();
+      size_t count = (length + settings.blockSize - 1) / settings.blockSize;
+      if(slots.size() < count * slotSize) slots.resize(count * slotSize);
+      BlockArchive::encodeBlocks(data, length, settings, &pool, slots.data(), blocks, state);
+      unsigned char flags = BlockArchive::flags(settings);
+      Stats::Timer timer(settings.stats, Stats::WRITE);
+      for(size_t i=0; i<count; i++){
+        Block& b = blocks[first + i];
+        b.offset = offset;
+        out.write((const char*)slots.data() + i*slotSize, BlockArchive::blockLength(b.payloadSize, flags));
+        offset += BlockArchive::blockLength(b.payloadSize, flags);
+      }
+    }
+
+    static size_t indexSize(size_t blockCount, size_t directoryLength = 0){
+      return 1 + directoryLength + blockCount*INDEX_ENTRY_SIZE + FOOTER_SIZE;
+    }
+    //writes the end marker, the directory of a batch archive, index and footer (indexSize bytes)
+    //to out, offset is where they start
+    static void writeIndex(unsigned char* out, const std::vector<Block>& blocks, uint64_t offset, const std::string& directory = std::string()){
+      out[0] = BLOCK_END;
+      memcpy(out + 1, directory.data(), directory.length());
+      uint64_t indexOffset = offset + 1 + directory.length();
+      unsigned char* entry = out + 1 + directory.length();
+      for(const Block& b : blocks){
+        setUint(entry, b.offset, 8);
+        setUint(entry + 8, b.rawSize, 4);
+        setUint(entry + 12, b.payloadSize, 4);
+        entry += INDEX_ENTRY_SIZE;
+      }
+      setUint(entry, indexOffset, 8);
+      setUint(entry + 8, blocks.size(), 4);
+      entry[12] = 0xBD;
+      entry[13] = 0xAD;
+    }
+    //as above to a stream, for a whole archive of raw bytes also counts both sizes in stats
+    static bool writeIndex(std::ostream& out, const std::vector<Block>& blocks, uint64_t offset, Stats* stats = NULL, const std::string& directory = std::string()){
+      std::vector<unsigned char> tail(indexSize(blocks.size(), directory.length()));
+      BlockArchive::writeIndex(tail.data(), blocks, offset, directory);
+      Stats::Timer timer(stats, Stats::WRITE);
+      out.write((const char*)tail.data(), tail.size());
+      out.flush();
+      if(stats){
+        stats->rawBytes += blocks.empty() ? 0 : blocks.back().rawOffset + blocks.back().rawSize;
+        stats->archiveBytes += offset + tail.size();
+      }
+      return (bool)out;
+    }
+
+    //directory of a batch archive, sorted by name:
+    //per member raw offset (8 B), raw size (8 B), name offset (4 B), name length (4 B),
+    //then the names back to back, the length of the names (8 B) and the member count (4 B)
+    static std::string directory(std::vector<Member>& members){
+      std::sort(members.begin(), members.end(), [](const Member& a, const Member& b){ return a.name < b.name; });
+      size_t namesLength = 0;
+      for(const Member& m : members) namesLength += m.name.length();
+      std::string out(members.size()*DIRECTORY_ENTRY_SIZE + namesLength + DIRECTORY_TRAILER_SIZE, '\0');
+      unsigned char* entry = (unsigned char*)&out[0];
+      unsigned char* names = entry + members.size()*DIRECTORY_ENTRY_SIZE;
+      uint64_t nameOffset = 0;
+      for(const Member& m : members){
+        setUint(entry, m.rawOffset, 8);
+        setUint(entry + 8, m.rawSize, 8);
+        setUint(entry + 16, nameOffset, 4);
+        setUint(entry + 20, m.name.length(), 4);
+        memcpy(names + nameOffset, m.name.data(), m.name.length());
+        nameOffset += m.name.length();
+        entry += DIRECTORY_ENTRY_SIZE;
+      }
+      setUint(names + namesLength, namesLength, 8);
+      setUint(names + namesLength + 8, members.size(), 4);
+      return out;
+    }
+
+    //compresses in into out one batch of blocks at a time, the blocks of a batch are coded on the pool
+    //the output does not depend on the pool size
+    static bool compressStream(std::istream& in, std::ostream& out, const Settings& settings, ThreadPool& pool){
+      std::string head = BlockArchive::header(settings);
+      out.write(head.data(), head.length());
+      uint64_t offset = head.length();
+      std::vector<Block> blocks;
+      std::vector<unsigned char> buffer(size_t(settings.blockSize) * pool.size());
+      std::vector<unsigned char> slots;
+      EncodeState state;
+      while(true){
+        size_t length = readFully(in, buffer.data(), buffer.size(), settings.stats);
+        if(length == 0) break;
+        BlockArchive::writeBatch(buffer.data(), length, out, settings, pool, slots, state, blocks, offset);
+        if(!out) return false;
+      }
+      return BlockArchive::writeIndex(out, blocks, offset, settings.stats);
+    }
+
+    //as compressStream for input already in memory, e.g. a mapped file, the blocks are coded in place
+    static bool compressBuffer(const unsigned char* data, size_t length, std::ostream& out, const Settings& settings, ThreadPool& pool){
+      std::string head = BlockArchive::header(settings);
+      out.write(head.data(), head.length());
+      uint64_t offset = head.length();
+      std::vector<Block> blocks;
+      std::vector<unsigned char> slots;
+      EncodeState state;
+      size_t batchSize = size_t(settings.blockSize) * pool.size();
+      for(size_t pos=0; pos<length; pos+=batchSize){
+        BlockArchive::writeBatch(data + pos, std::min(batchSize, length - pos), out, settings, pool, slots, state, blocks, offset);
+        if(!out) return false;
+      }
+      return BlockArchive::writeIndex(out, blocks, offset, settings.stats);
+    }
+
+    //as above for data in memory, e.g. a mapped file
+    static void histogram(const unsigned char* data, size_t length, uint32_t blockSize, unsigned int stride, uint64_t frequencies[256], ThreadPool& pool){
+      if(stride > 1){
+        Histogram::countSampled(data, length, blockSize, stride, frequencies, pool);
+      }else{
+        Histogram::count(data, length, frequencies, pool);
+      }
+    }
+
+    //decompresses block by block without seeking, prefix holds bytes already taken from in
+    static bool decompressStream(std::istream& in, std::ostream& out, ThreadPool& pool, const std::string& prefix = "", Stats* stats = NULL){
+      std::string head = prefix;
+      head.resize(HEADER_SIZE + MAX_PACKED_TABLE_SIZE);
+      size_t headLength = prefix.length() + readFully(in, (unsigned char*)&head[prefix.length()], head.length() - prefix.length(), stats);
+      Info info;
+      if(!BlockArchive::parseHeader((const unsigned char*)head.data(), headLength, info)) return false;
+      std::unique_ptr<DecodeTable> sharedTable;
+      if(info.flags & FLAG_SHARED_TABLE) sharedTable.reset(new DecodeTable(info.sharedLengths));
+      std::vector<BlockScratch> scratch(pool.size());
+      //bytes read past the header belong to the first block
+      std::string pending = head.substr(info.headerLength, headLength - info.headerLength);
+      if(stats) stats->archiveBytes += info.headerLength;
+      std::vector<std::string> blocks(pool.size());
+      std::vector<std::string> decoded(pool.size());
+      //blocks may only reuse the table of the last block that had one, as the encoder writes them
+      std::string lastTable;
+      uint32_t lastTableBlock = 0;
+      uint32_t blockIndex = 0;
+      std::vector<std::string> reused(pool.size());
+      bool end = false;
+      while(!end){
+        //gather a batch of complete blocks
+        size_t batchBlocks = 0;
+        while(batchBlocks < blocks.size()){
+          std::string& block = blocks[batchBlocks];
+          block.swap(pending);
+          pending.clear();
+          if(block.length() < 1){
+            block.resize(1);
+            if(readFully(in, (unsigned char*)&block[0], 1, stats) != 1) return false; //truncated
+          }
+          if((unsigned char)block[0] == BLOCK_END){
+            if(stats) stats->archiveBytes += 1;
+            end = true;
+            break;
+          }
+          size_t have = block.length();
+          if(have < BLOCK_HEADER_SIZE){
+            block.resize(BLOCK_HEADER_SIZE);
+            if(readFully(in, (unsigned char*)&block[have], BLOCK_HEADER_SIZE - have, stats) != BLOCK_HEADER_SIZE - have) return false;
+            have = BLOCK_HEADER_SIZE;
+          }
+          uint32_t rawSize = getUint((const unsigned char*)block.data() + 1, 4);
+          uint32_t payloadSize = getUint((const unsigned char*)block.data() + 5, 4);
+          if(rawSize > info.blockSize || payloadSize > rawSize) return false;
+          size_t blockLength = BlockArchive::blockLength(payloadSize, info.flags);
+          if(have > blockLength){
+            pending = block.substr(blockLength);
+            block.resize(blockLength);
+          }else if(have < blockLength){
+            block.resize(blockLength);
+            if(readFully(in, (unsigned char*)&block[have], blockLength - have, stats) != blockLength - have) return false;
+          }
+          if(stats) stats->archiveBytes += blockLength;
+          uint32_t tableBlock;
+          reused[batchBlocks].clear();
+          if((unsigned char)block[0] == BLOCK_OWN_TABLE){
+            lastTable.assign(block, 0, BlockArchive::tablePrefix(blockLength));
+            lastTableBlock = blockIndex;
+          }else if(BlockArchive::reusedTable((const unsigned char*)block.data(), blockLength, tableBlock)){
+            if(lastTable.empty() || tableBlock != lastTableBlock) return false;
+            reused[batchBlocks] = lastTable;
+          }
+          blockIndex++;
+          batchBlocks++;
+        }
+        std::atomic<bool> ok{true};
+        pool.forEach(batchBlocks, [&](size_t i, unsigned int worker){
+          if(!BlockArchive::decodeBlock((const unsigned char*)blocks[i].data(), blocks[i].length(), sharedTable.get(), reused[i], info.flags, scratch[worker], decoded[i], stats)) ok = false;
+        });
+        if(!ok) return false;
+        Stats::Timer timer(stats, Stats::WRITE);
+        for(size_t i=0; i<batchBlocks; i++){
+          out.write(decoded[i].data(), decoded[i].length());
+          if(stats) stats->rawBytes += decoded[i].length();
+        }
+        if(!out) return false;
+      }
+      Stats::Timer timer(stats, Stats::WRITE);
+      out.flush();
+      return (bool)out;
+    }
+
+    //locates the index from the footer, false if malformed
+    static bool parseFooter(const unsigned char* footer, uint64_t archiveLength, const Info& info, uint64_t& indexOffset, uint64_t& blockCount){
+      if(footer[12] != 0xBD || footer[13] != 0xAD) return false;
+      indexOffset = getUint(footer, 8);
+      blockCount = getUint(footer + 8, 4);
+      uint64_t indexEnd = archiveLength - FOOTER_SIZE;
+      return indexOffset >= info.headerLength + 1 && indexOffset <= indexEnd && (indexEnd - indexOffset) / INDEX_ENTRY_SIZE == blockCount;
+    }
+
+    static bool parseIndex(const unsigned char* index, uint64_t indexOffset, uint64_t blockCount, Info& info){
+      info.blocks.clear();
+      info.rawSize = 0;
+      for(uint64_t i=0; i<blockCount; i++){
+        const unsigned char* entry = index + i*INDEX_ENTRY_SIZE;
+        Block b;
+        b.offset = getUint(entry, 8);
+        b.rawOffset = info.rawSize;
+        b.rawSize = getUint(entry + 8, 4);
+        b.payloadSize = getUint(entry + 12, 4);
+        if(b.offset < info.headerLength || b.offset + info.blockLength(b) >= indexOffset) return false;
+        if(b.rawSize > info.blockSize || b.payloadSize > b.rawSize) return false; //coded blocks are smaller than stored ones
+        info.rawSize += b.rawSize;
+        info.blocks.push_back(b);
+      }
+      return true;
+    }
+
+    //parses header and index of a seekable archive, false for a malformed archive
+    static bool readInfo(std::istream& in, Info& info){
+      in.seekg(0, std::ios::end);
+      uint64_t archiveLength = in.tellg();
+      if(!in || archiveLength < HEADER_SIZE + FOOTER_SIZE + 1) return false;
+      std::string head(std::min<uint64_t>(archiveLength, HEADER_SIZE + MAX_PACKED_TABLE_SIZE), '\0');
+      in.seekg(0);
+      if(readFully(in, (unsigned char*)&head[0], head.length()) != head.length()) return false;
+      if(!BlockArchive::parseHeader((const unsigned char*)head.data(), head.length(), info)) return false;
+      unsigned char footer[FOOTER_SIZE];
+      in.seekg(archiveLength - FOOTER_SIZE);
+      if(readFully(in, footer, FOOTER_SIZE) != FOOTER_SIZE) return false;
+      if(!BlockArchive::parseFooter(footer, archiveLength, info, info.indexOffset, info.blockCount)) return false;
+      std::vector<unsigned char> index(info.blockCount * INDEX_ENTRY_SIZE);
+      in.seekg(info.indexOffset);
+      if(readFully(in, index.data(), index.size()) != index.size()) return false;
+      info.firstBlock = 0;
+      return BlockArchive::parseIndex(index.data(), info.indexOffset, info.blockCount, info);
+    }
+
+    //as above for an archive in memory
+    static bool readInfo(const unsigned char* archive, size_t archiveLength, Info& info){
+      if(!BlockArchive::readFooter(archive, archiveLength, info)) return false;
+      info.firstBlock = 0;
+      return BlockArchive::parseIndex(archive + info.indexOffset, info.indexOffset, info.blockCount, info);
+    }
+    //header and footer of an archive in memory, leaves the index to be read
+    static bool readFooter(const unsigned char* archive, size_t archiveLength, Info& info){
+      if(archiveLength < HEADER_SIZE + FOOTER_SIZE + 1) return false;
+      if(!BlockArchive::parseHeader(archive, std::min<size_t>(archiveLength, HEADER_SIZE + MAX_PACKED_TABLE_SIZE), info)) return false;
+      return BlockArchive::parseFooter(archive + archiveLength - FOOTER_SIZE, archiveLength, info, info.indexOffset, info.blockCount);
+    }
+    //entry i of the index of an archive in memory, rawOffset is left unset
+    static bool indexEntry(const unsigned char* archive, const Info& info, uint64_t i, Block& b){
+      if(i >= info.blockCount) return false;
+      const unsigned char* entry = archive + info.indexOffset + i*INDEX_ENTRY_SIZE;
+      b.offset = getUint(entry, 8);
+      b.rawOffset = 0;
+      b.rawSize = getUint(entry + 8, 4);
+      b.payloadSize = getUint(entry + 12, 4);
+      if(b.offset < info.headerLength || b.offset + info.blockLength(b) >= info.indexOffset) return false;
+      return b.rawSize <= info.blockSize && b.payloadSize <= b.rawSize;
+    }
+
+    //locates the directory of a batch archive in front of its index, false if malformed
+    static bool readDirectory(const unsigned char* archive, const Info& info, Directory& directory){
+      if(!(info.flags & FLAG_DIRECTORY)) return false;
+      uint64_t start = info.headerLength + 1; //right after the end marker at the earliest
+      if(info.indexOffset < start + DIRECTORY_TRAILER_SIZE) return false;
+      const unsigned char* trailer = archive + info.indexOffset - DIRECTORY_TRAILER_SIZE;
+      uint64_t space = info.indexOffset - DIRECTORY_TRAILER_SIZE - start;
+      directory.namesLength = getUint(trailer, 8);
+      directory.count = getUint(trailer + 8, 4);
+      if(directory.namesLength > space || (space - directory.namesLength) / DIRECTORY_ENTRY_SIZE < directory.count) return false;
+      directory.names = trailer - directory.namesLength;
+      directory.entries = directory.names - uint64_t(directory.count)*DIRECTORY_ENTRY_SIZE;
+      return true;
+    }
+    //name of member i, pointing into the archive, false if it lies outside the names
+    static bool memberName(const Directory& directory, size_t i, const char*& name, size_t& nameLength){
+      const unsigned char* entry = directory.entries + i*DIRECTORY_ENTRY_SIZE;
+      uint64_t nameOffset = getUint(entry + 16, 4);
+      nameLength = getUint(entry + 20, 4);
+      if(nameOffset > directory.namesLength || nameLength > directory.namesLength - nameOffset) return false;
+      name = (const char*)directory.names + nameOffset;
+      return true;
+    }
+    //member i of the directory, false if its entry is malformed
+    static bool member(const Directory& directory, const Info& info, size_t i, Member& m){
+      const char* name;
+      size_t nameLength;
+      if(i >= directory.count || !BlockArchive::memberName(directory, i, name, nameLength)) return false;
+      const unsigned char* entry = directory.entries + i*DIRECTORY_ENTRY_SIZE;
+      m.name.assign(name, nameLength);
+      m.rawOffset = getUint(entry, 8);
+      m.rawSize = getUint(entry + 8, 8);
+      //within the blocks, which all but the last have the block size
+      uint64_t rawLimit = info.blockCount * info.blockSize;
+      return m.rawOffset <= rawLimit && m.rawSize <= rawLimit - m.rawOffset;
+    }
+    //position of the member with the given name, by binary search over the sorted directory
+    //false if there is none
+    static bool findMember(const Directory& directory, const std::string& name, size_t& i){
+      size_t low = 0, high = directory.count;
+      while(low < high){
+        size_t mid = low + (high - low)/2;
+        const char* midName;
+        size_t midLength;
+        if(!BlockArchive::memberName(directory, mid, midName, midLength)) return false;
+        int c = memcmp(midName, name.data(), std::min(midLength, name.length()));
+        if(c == 0) c = (midLength < name.length() ? -1 : midLength > name.length() ? 1 : 0);
+        if(c == 0){
+          i = mid;
+          return true;
+        }
+        if(c < 0){
+          low = mid + 1;
+        }else{
+          high = mid;
+        }
+      }
+      return false;
+    }
+
+    //blocks [first, last) cover the original bytes [offset, offset+length)
+    static void coveringBlocks(const Info& info, uint64_t offset, uint64_t length, size_t& first, size_t& last){
+      //first block ending past offset
+      first = std::upper_bound(info.blocks.begin(), info.blocks.end(), offset,
+        [](uint64_t off, const Block& b){ return off < b.rawOffset + b.rawSize; }) - info.blocks.begin();
+      last = first;
+      while(last < info.blocks.size() && info.blocks[last].rawOffset < offset + length) last++;
+    }
+
+    //writes the original bytes [offset, offset+length) of a seekable archive to out,
+    //only the blocks covering them are read, a batch at a time decoded on the pool
+    static bool extractRange(std::istream& in, uint64_t offset, uint64_t length, std::ostream& out, ThreadPool& pool, Stats* stats = NULL){
+      Info info;
+      if(!BlockArchive::readInfo(in, info)) return false;
+      if(offset >= info.rawSize) return true;
+      length = std::min(length, info.rawSize - offset);
+      std::unique_ptr<DecodeTable> sharedTable;
+      if(info.flags & FLAG_SHARED_TABLE) sharedTable.reset(new DecodeTable(info.sharedLengths));
+      std::vector<BlockScratch> scratch(pool.size());
+      size_t first, last;
+      BlockArchive::coveringBlocks(info, offset, length, first, last);
+      std::vector<std::string> blocks(pool.size());
+      std::vector<std::string> decoded(pool.size());
+      std::vector<std::string> reused(pool.size()); //tables of earlier blocks, read when a block refers to one
+      for(size_t batch=first; batch<last; batch+=pool.size()){
+        size_t batchBlocks = std::min<size_t>(pool.size(), last - batch);
+        for(size_t i=0; i<batchBlocks; i++){
+          const Block& b = info.blocks[batch + i];
+          blocks[i].resize(info.blockLength(b));
+          in.seekg(b.offset);
+          if(readFully(in, (unsigned char*)&blocks[i][0], blocks[i].length(), stats) != blocks[i].length()) return false;
+          if(stats) stats->archiveBytes += blocks[i].length();
+          uint32_t tableBlock;
+          reused[i].clear();
+          if(BlockArchive::reusedTable((const unsigned char*)blocks[i].data(), blocks[i].length(), tableBlock)){
+            if(tableBlock >= batch + i) return false;
+            const Block& t = info.blocks[tableBlock];
+            reused[i].resize(BlockArchive::tablePrefix(BLOCK_HEADER_SIZE + t.payloadSize));
+            in.seekg(t.offset);
+            if(readFully(in, (unsigned char*)&reused[i][0], reused[i].length(), stats) != reused[i].length()) return false;
+            if(stats) stats->archiveBytes += reused[i].length();
+          }
+        }
+        std::atomic<bool> ok{true};
+        pool.forEach(batchBlocks, [&](size_t i, unsigned int worker){
+          const Block& b = info.blocks[batch + i];
+          if(!BlockArchive::decodeBlock((const unsigned char*)blocks[i].data(), blocks[i].length(), sharedTable.get(), reused[i], info.flags, scratch[worker], decoded[i], stats) || decoded[i].length() != b.rawSize) ok = false;
+        });
+        if(!ok) return false;
+        Stats::Timer timer(stats, Stats::WRITE);
+        for(size_t i=0; i<batchBlocks; i++){
+          const Block& b = info.blocks[batch + i];
+          uint64_t from = std::max(offset, b.rawOffset);
+          uint64_t to = std::min<uint64_t>(offset + length, b.rawOffset + b.rawSize);
+          out.write(decoded[i].data() + (from - b.rawOffset), to - from);
+          if(stats) stats->rawBytes += to - from;
+        }
+        if(!out) return false;
+      }
+      Stats::Timer timer(stats, Stats::WRITE);
+      out.flush();
+      return (bool)out;
+    }
+};
+
+//caller-owned memory
+template<typename T>
+struct Span{
+  T* data = NULL;
+  size_t size = 0;
+  Span(){}
+  Span(T* data, size_t size) : data(data), size(size){}
+};
+
+//bump allocator for the buffers of one job, e.g. one file of a batch: allocate() hands out
+//uninitialized memory from large chunks, reset() takes all of it back at once
+//the chunks are kept, and merged into one if a job needed several, so after the largest
+//job so far the next ones allocate nothing from the heap and fill no memory they overwrite
+class Arena{
+  private:
+    static const size_t MIN_CHUNK = 64 << 10;
+    static const size_t ALIGNMENT = 64;
+    struct Chunk{
+      std::unique_ptr<unsigned char[]> data;
+      size_t size;
+    };
+    std::vector<Chunk> chunks;
+    size_t current = 0; //chunk allocations come from
+    size_t used = 0; //bytes of the current chunk handed out
+    size_t last = 0; //offset of the latest allocation in the current chunk
+  public:
+    //count elements of a type without constructor, valid until reset()
+    template<typename T>
+    Span<T> allocate(size_t count){
+      static_assert(std::is_trivially_copyable<T>::value, "the arena does not construct objects");
+      size_t bytes = count * sizeof(T);
+      size_t offset = (used + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+      while(current < chunks.size() && offset + bytes > chunks[current].size){
+        current++;
+        offset = 0;
+      }
+      if(current == chunks.size()){
+        size_t size = std::max(bytes, chunks.empty() ? size_t(MIN_CHUNK) : 2*chunks.back().size);
+        chunks.push_back(Chunk{std::unique_ptr<unsigned char[]>(new unsigned char[size]), size});
+        offset = 0;
+      }
+      last = offset;
+      used = offset + bytes;
+      return Span<T>((T*)(chunks[current].data.get() + offset), count);
+    }
+    //cuts the latest allocation down to count elements, the rest goes to the next one
+    template<typename T>
+    void shrink(Span<T>& span, size_t count){
+      if(count >= span.size) return;
+      if(chunks.size() > current && (unsigned char*)span.data == chunks[current].data.get() + last) used = last + count * sizeof(T);
+      span.size = count;
+    }
+    //frees everything handed out since the last reset
+    void reset(){
+      if(chunks.size() > 1 && current > 0){
+        size_t total = 0;
+        for(const Chunk& c : chunks) total += c.size;
+        chunks.clear();
+        chunks.push_back(Chunk{std::unique_ptr<unsigned char[]>(new unsigned char[total]), total});
+      }
+      current = 0;
+      used = 0;
+      last = 0;
+    }
+    //bytes held, whether handed out or not
+    size_t capacity() const {
+      size_t total = 0;
+      for(const Chunk& c : chunks) total += c.size;
+      return total;
+    }
+};
+
+//compresses buffers into version 3 archives, the library side of the CLI
+//the caller provides both buffers, bound() tells how large the output has to be
+//scratch space is kept between calls, so once it has grown nothing is allocated
+//(with a pool, handing out the blocks still costs a few small allocations) and nothing is printed
+class Encoder{
+  private:
+    BlockArchive::Settings settings;
+    unsigned char sharedLengths[256] = {0};
+    ThreadPool* pool;
+    std::vector<BlockArchive::Block> blocks;
+    BlockArchive::EncodeState state;
+  public:
+    //settings.sharedLengths is copied, the pool has to outlive the encoder
+    Encoder(const BlockArchive::Settings& settings = BlockArchive::Settings(), ThreadPool* pool = NULL){
+      this->settings = settings;
+      if(settings.sharedLengths){
+        memcpy(this->sharedLengths, settings.sharedLengths, 256);
+        this->settings.sharedLengths = this->sharedLengths;
+      }
+      this->pool = pool;
+    }
+    //largest archive of an input of size bytes
+    size_t bound(size_t size) const {
+      size_t count = (size + settings.blockSize - 1) / settings.blockSize;
+      //blocks are coded into slots of the full block size, the last one only needs its own
+      size_t slots = (count == 0 ? 0 : (count - 1) * BlockArchive::blockBound(settings.blockSize) + BlockArchive::blockBound(size - (count - 1) * settings.blockSize));
+      return BlockArchive::HEADER_SIZE + BlockArchive::MAX_PACKED_TABLE_SIZE + slots + BlockArchive::indexSize(count);
+    }
+    //compresses in into out, returns the archive length, 0 if out is smaller than bound(in.size)
+    size_t encode(Span<const unsigned char> in, Span<unsigned char> out){
+      if(out.size < this->bound(in.size)) return 0;
+      Stats* stats = settings.stats;
+      size_t offset = BlockArchive::header(settings, out.data);
+      //the blocks are coded into slots of the largest block size, then moved together
+      //a batch at a time, which bounds the plans kept in the state
+      unsigned char* slots = out.data + offset;
+      size_t slotSize = BlockArchive::blockBound(settings.blockSize);
+      size_t batchSize = size_t(settings.blockSize) * (pool ? pool->size() : 1);
+      blocks.clear();
+      state.hasTable = false;
+      for(size_t pos=0; pos<in.size; pos+=batchSize){
+        BlockArchive::encodeBlocks(in.data + pos, std::min(batchSize, in.size - pos), settings, pool, slots + blocks.size()*slotSize, blocks, state);
+      }
+      Stats::Timer timer(stats, Stats::SERIALIZE);
+      for(size_t i=0; i<blocks.size(); i++){
+        BlockArchive::Block& b = blocks[i];
+        size_t length = BlockArchive::blockLength(b.payloadSize, BlockArchive::flags(settings));
+        memmove(out.data + offset, slots + i*slotSize, length);
+        b.offset = offset;
+        offset += length;
+      }
+      BlockArchive::writeIndex(out.data + offset, blocks, offset);
+      size_t length = offset + BlockArchive::indexSize(blocks.size());
+      if(stats){
+        stats->rawBytes += in.size;
+        stats->archiveBytes += length;
+      }
+      return length;
+    }
+    //as above into a buffer of bound(in.size) bytes from the arena, cut down to the archive
+    Span<unsigned char> encode(Span<const unsigned char> in, Arena& arena){
+      Span<unsigned char> out = arena.allocate<unsigned char>(this->bound(in.size));
+      arena.shrink(out, this->encode(in, out));
+      return out;
+    }
+};
+
+//decompresses version 3 archives in memory into caller-provided buffers, the counterpart of Encoder
+//open() tells the decompressed size up front, any byte range can then be decoded
+//as with the encoder, scratch space is kept between calls
+class Decoder{
+  private:
+    ThreadPool* pool;
+    Span<const unsigned char> archive;
+    BlockArchive::Info info;
+    BlockArchive::Directory directory; //of an open batch archive
+    BlockArchive::Member member; //scratch for openMember
+    uint64_t base = 0; //raw offset of the open member in the archive's data
+    DecodeTable sharedTable;
+    std::vector<BlockArchive::BlockScratch> scratch; //per thread
+    std::vector<std::vector<char>> partial; //per thread, for blocks only partly in a range
+    Stats* stats;
+    //decodes block i of the open archive or member whole into out
+    bool decodeWhole(size_t i, unsigned int worker, char* out){
+      const BlockArchive::Block& b = info.blocks[i];
+      const unsigned char* block = archive.data + b.offset;
+      size_t blockLength = info.blockLength(b);
+      const DecodeTable* shared = (info.flags & BlockArchive::FLAG_SHARED_TABLE) ? &sharedTable : NULL;
+      const unsigned char* tableBlock = NULL;
+      size_t tableBlockLength = 0;
+      uint32_t t;
+      if(BlockArchive::reusedTable(block, blockLength, t)){
+        //members may reuse the table of a block before them
+        BlockArchive::Block table;
+        if(t >= info.firstBlock + i) return false;
+        if(t >= info.firstBlock){
+          table = info.blocks[t - info.firstBlock];
+        }else if(!BlockArchive::indexEntry(archive.data, info, t, table)){
+          return false;
+        }
+        tableBlock = archive.data + table.offset;
+        tableBlockLength = info.blockLength(table);
+      }
+      return BlockArchive::decodeBlock(block, blockLength, shared, tableBlock, tableBlockLength, info.flags, scratch[worker], out, b.rawSize, stats);
+    }
+  public:
+    //the pool and stats, both optional, have to outlive the decoder
+    Decoder(ThreadPool* pool = NULL, Stats* stats = NULL){
+      this->pool = pool;
+      this->stats = stats;
+      scratch.resize(pool ? pool->size() : 1);
+      partial.resize(pool ? pool->size() : 1);
+    }
+    //reads header and index of an archive, which has to stay in memory while it is decoded
+    //false if it is malformed
+    bool open(Span<const unsigned char> archive){
+      this->archive = Span<const unsigned char>();
+      directory = BlockArchive::Directory();
+      base = 0;
+      Stats::Timer timer(stats, Stats::SERIALIZE);
+      if(!BlockArchive::readInfo(archive.data, archive.size, info)){
+        info.blocks.clear();
+        info.rawSize = 0;
+        return false;
+      }
+      if(info.flags & BlockArchive::FLAG_SHARED_TABLE) sharedTable.assign(EncodeTable(info.sharedLengths));
+      this->archive = archive;
+      if(stats) stats->archiveBytes += archive.size;
+      return true;
+    }
+    //reads header and directory of a batch archive (see BlockArchive::FLAG_DIRECTORY), its
+    //members are then opened one at a time, each only reading the index entries of its blocks
+    //false if it is malformed or no batch archive
+    bool openBatch(Span<const unsigned char> archive){
+      this->archive = Span<const unsigned char>();
+      directory = BlockArchive::Directory();
+      info.blocks.clear();
+      info.rawSize = 0;
+      Stats::Timer timer(stats, Stats::SERIALIZE);
+      if(!BlockArchive::readFooter(archive.data, archive.size, info) || !BlockArchive::readDirectory(archive.data, info, directory)){
+        directory = BlockArchive::Directory();
+        return false;
+      }
+      if(info.flags & BlockArchive::FLAG_SHARED_TABLE) sharedTable.assign(EncodeTable(info.sharedLengths));
+      this->archive = archive;
+      if(stats) stats->archiveBytes += archive.size;
+      return true;
+    }
+    //members of the open batch archive, listed by name
+    size_t memberCount() const {
+      return directory.count;
+    }
+    //position of the member with this name, false if there is none
+    bool findMember(const std::string& name, size_t& i) const {
+      return BlockArchive::findMember(directory, name, i);
+    }
+    //entry i of the directory, false if it is malformed
+    bool memberAt(size_t i, BlockArchive::Member& m) const {
+      return BlockArchive::member(directory, info, i, m);
+    }
+    //makes member i of the open batch archive what rawSize() and decode() refer to
+    //false if its entry or the blocks holding it are malformed
+    bool openMember(size_t i){
+      info.blocks.clear();
+      info.rawSize = 0;
+      base = 0;
+      return this->memberAt(i, member) && this->openRange(member.rawOffset, member.rawSize);
+    }
+    //as openMember for the raw bytes [rawOffset, rawOffset+rawSize) of the open batch archive,
+    //e.g. several members next to each other
+    bool openRange(uint64_t rawOffset, uint64_t rawSize){
+      info.blocks.clear();
+      info.rawSize = 0;
+      base = 0;
+      if(rawSize == 0) return true;
+      if(info.blockSize == 0 || rawOffset > info.blockCount * info.blockSize || rawSize > info.blockCount * info.blockSize - rawOffset) return false;
+      //all blocks but the last have the block size, so the blocks follow from the offset
+      uint64_t first = rawOffset / info.blockSize;
+      uint64_t last = (rawOffset + rawSize - 1) / info.blockSize;
+      for(uint64_t k=first; k<=last; k++){
+        BlockArchive::Block b;
+        if(!BlockArchive::indexEntry(archive.data, info, k, b) || (b.rawSize != info.blockSize && k + 1 != info.blockCount)){
+          info.blocks.clear();
+          return false;
+        }
+        b.rawOffset = k * info.blockSize;
+        info.blocks.push_back(b);
+      }
+      if(info.blocks.back().rawOffset + info.blocks.back().rawSize < rawOffset + rawSize){
+        info.blocks.clear();
+        return false;
+      }
+      info.firstBlock = first;
+      info.rawSize = rawSize;
+      base = rawOffset;
+      return true;
+    }
+    //size of the decompressed data of the open archive
+    uint64_t rawSize() const {
+      return info.rawSize;
+    }
+    //where the block holding byte offset of the open archive starts in the archive, a caller
+    //decoding in order needs little before it, only the tables of reused-table blocks
+    uint64_t archiveOffset(uint64_t offset) const {
+      size_t first, last;
+      BlockArchive::coveringBlocks(info, base + offset, 1, first, last);
+      return first < info.blocks.size() ? info.blocks[first].offset : archive.size;
+    }
+    //decodes the original bytes [offset, offset+out.size) of the open archive into out
+    //false if the archive is corrupted or the range does not lie within rawSize()
+    bool decode(Span<unsigned char> out, uint64_t offset = 0){
+      if(offset > info.rawSize || out.size > info.rawSize - offset) return false;
+      if(out.size == 0) return true;
+      offset += base;
+      size_t first, last;
+      BlockArchive::coveringBlocks(info, offset, out.size, first, last);
+      std::atomic<bool> ok{true};
+      auto decodeBlock = [&](size_t i, unsigned int worker){
+        const BlockArchive::Block& b = info.blocks[first + i];
+        uint64_t from = std::max(offset, b.rawOffset);
+        uint64_t to = std::min<uint64_t>(offset + out.size, b.rawOffset + b.rawSize);
+        char* dst = (char*)out.data + (from - offset);
+        if(from == b.rawOffset && to == b.rawOffset + b.rawSize){
+          if(!this->decodeWhole(first + i, worker, dst)) ok = false;
+          return;
+        }
+        std::vector<char>& decoded = partial[worker];
+        if(decoded.size() < b.rawSize) decoded.resize(b.rawSize);
+        if(!this->decodeWhole(first + i, worker, decoded.data())){
+          ok = false;
+          return;
+        }
+        memcpy(dst, decoded.data() + (from - b.rawOffset), to - from);
+      };
+      if(pool){
+        pool->forEach(last - first, decodeBlock);
+      }else{
+        for(size_t i=first; i<last; i++) decodeBlock(i - first, 0);
+      }
+      if(stats) stats->rawBytes += out.size;
+      return ok;
+    }
+    //decodes the whole archive or open member into rawSize() bytes from the arena
+    bool decode(Arena& arena, Span<unsigned char>& out){
+      out = arena.allocate<unsigned char>(info.rawSize);
+      return this->decode(out);
+    }
+    //decodes every block of the open archive or member, a block at a time per thread, and drops
+    //the output; false if one is corrupted, which includes failing its checksum if the archive
+    //has BlockArchive::FLAG_CHECKSUMS
+    bool verify(){
+      std::atomic<bool> ok{true};
+      auto verifyBlock = [&](size_t i, unsigned int worker){
+        std::vector<char>& decoded = partial[worker];
+        if(decoded.size() < info.blocks[i].rawSize) decoded.resize(info.blocks[i].rawSize);
+        if(!this->decodeWhole(i, worker, decoded.data())) ok = false;
+      };
+      if(pool){
+        pool->forEach(info.blocks.size(), verifyBlock);
+      }else{
+        for(size_t i=0; i<info.blocks.size(); i++) verifyBlock(i, 0);
+      }
+      if(stats) stats->rawBytes += info.rawSize;
+      return ok;
+    }
+};
+
+//adaptive Huffman tree after Faller, Gallager and Knuth (FGK), updated after every symbol
+//the tree keeps the sibling property: listed from the root by decreasing weight, siblings
+//are next to each other, which makes it a Huffman tree for the counts so far. To count a symbol
+//its leaf and every node above it are swapped with the first node of their weight, then incremented
+//symbols not seen yet are sent as the code of a zero-weight escape leaf followed by their 8 bits
+//below 2^64 symbols a Huffman tree is less than 93 levels deep (weights growing like Fibonacci
+//numbers), so escape and symbol together stay below 128 bits
+class AdaptiveTree{
+  public:
+    static const unsigned int MAX_CODE_BYTES = 16;
+  private:
+    static const int NONE = -1;
+    static const int MAX_NODES = 2*257 - 1; //256 symbol leaves and the escape leaf
+    struct Node{
+      uint64_t weight = 0;
+      int parent = NONE;
+      int child = NONE; //left child, the right one follows it, NONE for leaves
+      int symbol = NONE; //of a leaf, NONE for the escape leaf
+    };
+    Node nodes[MAX_NODES];
+    int leaves[256];
+    int escape = 0; //always the last node
+    //points children, leaf or escape at the node's new position
+    void adopt(int node){
+      const Node& n = nodes[node];
+      if(n.child != NONE){
+        nodes[n.child].parent = node;
+        nodes[n.child + 1].parent = node;
+      }else if(n.symbol != NONE){
+        leaves[n.symbol] = node;
+      }else{
+        escape = node;
+      }
+    }
+    //exchanges the subtrees at two positions, the parents stay with the positions
+    void swap(int a, int b){
+      std::swap(nodes[a].weight, nodes[b].weight);
+      std::swap(nodes[a].child, nodes[b].child);
+      std::swap(nodes[a].symbol, nodes[b].symbol);
+      this->adopt(a);
+      this->adopt(b);
+    }
+    void update(unsigned char c){
+      int node = leaves[c];
+      if(node == NONE){
+        //the escape leaf becomes the parent of the new leaf and of the next escape leaf
+        int parent = escape;
+        nodes[parent].child = parent + 1;
+        nodes[parent + 1] = Node();
+        nodes[parent + 1].parent = parent;
+        nodes[parent + 1].symbol = c;
+        nodes[parent + 2] = Node();
+        nodes[parent + 2].parent = parent;
+        leaves[c] = parent + 1;
+        escape = parent + 2;
+        node = parent + 1;
+      }
+      while(true){
+        //only the parent can share the weight of a node among its ancestors
+        int leader = node;
+        while(leader > 0 && nodes[leader - 1].weight == nodes[node].weight) leader--;
+        if(leader != node && leader != nodes[node].parent){
+          this->swap(node, leader);
+          node = leader;
+        }
+        nodes[node].weight++;
+        if(node == 0) break;
+        node = nodes[node].parent;
+      }
+    }
+  public:
+    AdaptiveTree(){
+      this->reset();
+    }
+    //back to the tree of an empty stream, the escape leaf alone
+    void reset(){
+      for(int i=0; i<MAX_NODES; i++) nodes[i] = Node();
+      for(int c=0; c<256; c++) leaves[c] = NONE;
+      escape = 0;
+    }
+    //codes c, at most MAX_CODE_BYTES, and counts it
+    void encode(unsigned char c, BitWriter& writer){
+      //the path is collected from the leaf up, so the root's branch ends up in the highest bit
+      uint64_t low = 0;
+      uint64_t high = 0;
+      unsigned int length = 0;
+      for(int node = (leaves[c] != NONE ? leaves[c] : escape); node != 0; node = nodes[node].parent){
+        uint64_t bit = (node != nodes[nodes[node].parent].child);
+        if(length < 64){
+          low |= bit << length;
+        }else{
+          high |= bit << (length - 64);
+        }
+        length++;
+      }
+      if(length > 64){
+        writer.put(high, length - 64);
+        writer.put(low, 64);
+      }else if(length > 0){
+        writer.put(low, length);
+      }
+      if(leaves[c] == NONE) writer.put(c, 8);
+      this->update(c);
+    }
+    //decodes one symbol from the reader and counts it, false if its code runs past totalBits
+    bool decode(BitReader& reader, uint64_t totalBits, unsigned char& c){
+      unsigned int buffered = 0;
+      auto refill = [&](){
+        reader.refill();
+        buffered = std::min<uint64_t>(56, totalBits - reader.position());
+      };
+      refill();
+      int node = 0;
+      while(nodes[node].child != NONE){
+        if(buffered == 0){
+          refill();
+          if(buffered == 0) return false;
+        }
+        node = nodes[node].child + (reader.peek() >> 63);
+        reader.consume(1);
+        buffered--;
+      }
+      if(node == escape){
+        if(buffered < 8) refill();
+        if(buffered < 8) return false;
+        c = reader.peek() >> 56;
+        reader.consume(8);
+      }else{
+        c = nodes[node].symbol;
+      }
+      this->update(c);
+      return true;
+    }
+};
+
+//adaptive code rebuilt from the counts at growing intervals, the faster alternative to
+//AdaptiveTree: between rebuilds symbols go through the table coders of the block archives
+//the stream starts with a flat 8 bit code, the intervals double from FIRST_INTERVAL symbols
+//up to the stream's longest one, and the counts are halved once they add up to AGE_LIMIT,
+//so the code follows data whose statistics drift
+//each run of symbols between rebuilds is padded to a byte, where the decoder's lookups start
+class AdaptiveCode{
+  public:
+    static const unsigned int MAX_CODE_LENGTH = 12; //every code resolves in one lookup
+    static const uint64_t FIRST_INTERVAL = 256;
+    static const uint64_t AGE_LIMIT = 1 << 20;
+  private:
+    uint64_t counts[256];
+    uint64_t total = 0;
+    uint64_t interval = 0; //symbols between the last two rebuilds
+    uint64_t maxInterval;
+    uint64_t untilRebuild = 0;
+    bool decoding;
+    EncodeTable encodeTable;
+    DecodeTable decodeTable;
+    void build(const unsigned char codeLengths[256]){
+      encodeTable = EncodeTable(codeLengths);
+      if(decoding) decodeTable.assign(encodeTable);
+    }
+    void rebuild(){
+      if(total > AGE_LIMIT){
+        total = 0;
+        for(int c=0; c<256; c++){
+          counts[c] = (counts[c] + 1) / 2;
+          total += counts[c];
+        }
+      }
+      unsigned char codeLengths[256];
+      Huffman::buildCodeLengths(counts, MAX_CODE_LENGTH, codeLengths);
+      this->build(codeLengths);
+      interval = std::min(2*interval, maxInterval);
+      untilRebuild = interval;
+    }
+    void count(const unsigned char* data, size_t n){
+      for(size_t i=0; i<n; i++) counts[data[i]]++;
+      total += n;
+      untilRebuild -= n;
+      if(untilRebuild == 0) this->rebuild();
+    }
+  public:
+    //maxInterval: symbols between the last rebuilds, decoding: tables for decode() are built too
+    AdaptiveCode(uint64_t maxInterval, bool decoding){
+      this->maxInterval = std::max(maxInterval, uint64_t(FIRST_INTERVAL));
+      this->decoding = decoding;
+      this->reset();
+    }
+    //back to the flat code of an empty stream
+    void reset(){
+      //every count starts at 1, so every symbol keeps a code
+      for(int c=0; c<256; c++) counts[c] = 1;
+      total = 256;
+      interval = FIRST_INTERVAL;
+      untilRebuild = interval;
+      unsigned char codeLengths[256];
+      memset(codeLengths, 8, 256);
+      this->build(codeLengths);
+    }
+    //symbols until the next rebuild, a run passed to encode() or decode() must not be longer
+    uint64_t run() const {
+      return untilRebuild;
+    }
+    //codes a run of count symbols, at most 12 bits each, and counts them
+    void encode(const unsigned char* data, size_t count, BitWriter& writer){
+      encodeTable.encode(data, count, writer);
+      this->count(data, count);
+    }
+    //decodes a run of count symbols from the size bytes at data and counts them
+    //used is set to the bytes the run took, false on invalid codes or too little data
+    bool decode(const unsigned char* data, size_t size, char* out, size_t count, size_t& used){
+      size_t written = 0;
+      uint64_t bitPos = 0;
+      decodeTable.decode(data, size, uint64_t(size)*8, out, count, written, bitPos);
+      if(written != count) return false;
+      used = (bitPos + 7) / 8;
+      this->count((const unsigned char*)out, count);
+      return true;
+    }
+};
+
+//version 4 streams: a single pass adaptive code for input that cannot wait for a first pass,
+//e.g. a socket or a pipe. Encoder and decoder start from the same model and change it the
+//same way after each symbol, so no table is stored and a frame can go out as soon as it is coded
+//header: magic, version, model (1 B), log2 of the longest rebuild interval (1 B, MODEL_REBUILD only)
+//frames: raw size (4 B), payload size (4 B), the coded bits padded to a byte
+//the model carries over from frame to frame, a frame with raw size 0 ends the stream
+class Adaptive{
+  public:
+    static const unsigned char VERSION = 0x04;
+    static const unsigned int MODEL_FGK = 0; //see AdaptiveTree
+    static const unsigned int MODEL_REBUILD = 1; //see AdaptiveCode
+    static const unsigned int DEFAULT_INTERVAL_SHIFT = 16;
+    static const unsigned int MIN_INTERVAL_SHIFT = 8;
+    static const unsigned int MAX_INTERVAL_SHIFT = 24;
+    static const size_t HEADER_SIZE = 5;
+    static const size_t FRAME_HEADER_SIZE = 8;
+    static const uint32_t MAX_FRAME_SIZE = 1 << 20;
+    static bool isStream(const unsigned char* serial, size_t length){
+      return length >= 3 && serial[0] == 0xAD && serial[1] == 0xBD && serial[2] == VERSION;
+    }
+    static size_t header(unsigned int model, unsigned int intervalShift, unsigned char* out){
+      out[0] = 0xAD; //header part 1
+      out[1] = 0xBD; //header part 2
+      out[2] = VERSION;
+      out[3] = model;
+      out[4] = (model == MODEL_REBUILD ? intervalShift : 0);
+      return HEADER_SIZE;
+    }
+    static bool parseHeader(const unsigned char* serial, size_t length, unsigned int& model, unsigned int& intervalShift){
+      if(length < HEADER_SIZE || !Adaptive::isStream(serial, length)) return false;
+      model = serial[3];
+      intervalShift = serial[4];
+      if(model == MODEL_FGK) return intervalShift == 0;
+      return model == MODEL_REBUILD && intervalShift >= MIN_INTERVAL_SHIFT && intervalShift <= MAX_INTERVAL_SHIFT;
+    }
+    //largest payload of a frame of size raw bytes, 12 bits and padding per symbol fit 2 bytes
+    static size_t payloadBound(unsigned int model, size_t size){
+      return size * (model == MODEL_FGK ? AdaptiveTree::MAX_CODE_BYTES : 2);
+    }
+    //largest frame of size raw bytes, with the slack a BitWriter needs
+    static size_t frameBound(unsigned int model, size_t size){
+      return FRAME_HEADER_SIZE + Adaptive::payloadBound(model, size) + 8;
+    }
+    static void setUint(unsigned char* out, uint64_t value, int bytes){
+      for(int i=0; i<bytes; i++) out[i] = (value >> (8*i)) & 0xFF;
+    }
+    static uint64_t getUint(const unsigned char* in, int bytes){
+      uint64_t v = 0;
+      for(int i=0; i<bytes; i++) v |= uint64_t(in[i]) << (8*i);
+      return v;
+    }
+};
+
+//compresses a stream frame by frame into a version 4 stream (see Adaptive), e.g. one frame
+//per read from a socket. The model lives in the encoder, so the frames of one encoder
+//make up one stream and are decoded in order
+class AdaptiveEncoder{
+  private:
+    unsigned int model;
+    unsigned int intervalShift;
+    AdaptiveTree tree;
+    AdaptiveCode code;
+    Stats* stats;
+  public:
+    //intervalShift: log2 of the longest rebuild interval of MODEL_REBUILD
+    AdaptiveEncoder(unsigned int model = Adaptive::MODEL_FGK, unsigned int intervalShift = Adaptive::DEFAULT_INTERVAL_SHIFT, Stats* stats = NULL)
+      : code(uint64_t(1) << intervalShift, false){
+      this->model = model;
+      this->intervalShift = intervalShift;
+      this->stats = stats;
+    }
+    //writes the stream header, HEADER_SIZE bytes, and starts a new stream
+    size_t header(unsigned char* out){
+      tree.reset();
+      code.reset();
+      if(stats) stats->archiveBytes += Adaptive::HEADER_SIZE;
+      return Adaptive::header(model, intervalShift, out);
+    }
+    //largest frame of size raw bytes
+    size_t frameBound(size_t size) const {
+      return Adaptive::frameBound(model, size);
+    }
+    //codes in, 1 to MAX_FRAME_SIZE bytes, as the next frame into out, returns the frame length
+    //0 if in is empty or too large, or out is smaller than frameBound(in.size)
+    size_t encodeFrame(Span<const unsigned char> in, Span<unsigned char> out){
+      if(in.size == 0 || in.size > Adaptive::MAX_FRAME_SIZE || out.size < this->frameBound(in.size)) return 0;
+      Stats::Timer timer(stats, Stats::CODE);
+      BitWriter writer(out.data + Adaptive::FRAME_HEADER_SIZE);
+      size_t payloadSize = 0;
+      if(model == Adaptive::MODEL_FGK){
+        for(size_t i=0; i<in.size; i++) tree.encode(in.data[i], writer);
+        payloadSize = writer.finish();
+      }else{
+        for(size_t done=0; done<in.size; ){
+          size_t count = std::min<uint64_t>(in.size - done, code.run());
+          code.encode(in.data + done, count, writer);
+          payloadSize = writer.finish();
+          done += count;
+        }
+      }
+      Adaptive::setUint(out.data, in.size, 4);
+      Adaptive::setUint(out.data + 4, payloadSize, 4);
+      if(stats){
+        stats->rawBytes += in.size;
+        stats->archiveBytes += Adaptive::FRAME_HEADER_SIZE + payloadSize;
+        stats->symbols += in.size;
+        stats->codedBits += payloadSize * 8;
+        stats->blocks++;
+      }
+      return Adaptive::FRAME_HEADER_SIZE + payloadSize;
+    }
+    //writes the frame that ends the stream, FRAME_HEADER_SIZE bytes
+    size_t end(unsigned char* out){
+      memset(out, 0, Adaptive::FRAME_HEADER_SIZE);
+      if(stats) stats->archiveBytes += Adaptive::FRAME_HEADER_SIZE;
+      return Adaptive::FRAME_HEADER_SIZE;
+    }
+};
+
+//decompresses version 4 streams frame by frame, the counterpart of AdaptiveEncoder
+class AdaptiveDecoder{
+  private:
+    unsigned int model = Adaptive::MODEL_FGK;
+    AdaptiveTree tree;
+    std::unique_ptr<AdaptiveCode> code;
+    Stats* stats;
+    bool read(std::istream& in, unsigned char* buffer, size_t size){
+      Stats::Timer timer(stats, Stats::READ);
+      in.read((char*)buffer, size);
+      return (size_t)in.gcount() == size;
+    }
+  public:
+    AdaptiveDecoder(Stats* stats = NULL){
+      this->stats = stats;
+    }
+    //reads the stream header, HEADER_SIZE bytes, and starts decoding a new stream
+    //false if it is malformed
+    bool open(const unsigned char* header, size_t length){
+      unsigned int intervalShift;
+      if(!Adaptive::parseHeader(header, length, model, intervalShift)) return false;
+      tree.reset();
+      if(model == Adaptive::MODEL_REBUILD) code.reset(new AdaptiveCode(uint64_t(1) << intervalShift, true));
+      if(stats) stats->archiveBytes += Adaptive::HEADER_SIZE;
+      return true;
+    }
+    //sizes from the header of the next frame, FRAME_HEADER_SIZE bytes, false if they are malformed
+    //a raw size of 0 ends the stream
+    bool frameSizes(const unsigned char* frameHeader, uint32_t& rawSize, uint32_t& payloadSize) const {
+      rawSize = Adaptive::getUint(frameHeader, 4);
+      payloadSize = Adaptive::getUint(frameHeader + 4, 4);
+      if(rawSize > Adaptive::MAX_FRAME_SIZE) return false;
+      return rawSize == 0 ? payloadSize == 0 : payloadSize <= Adaptive::payloadBound(model, rawSize);
+    }
+    //decodes the payload of the next frame into out, which holds the frame's raw size
+    //false if it is corrupted, the model is then out of step and the stream cannot go on
+    bool decodeFrame(Span<const unsigned char> payload, Span<unsigned char> out){
+      Stats::Timer timer(stats, Stats::CODE);
+      size_t used = 0;
+      if(model == Adaptive::MODEL_FGK){
+        BitReader reader(payload.data, payload.size);
+        uint64_t totalBits = uint64_t(payload.size) * 8;
+        for(size_t i=0; i<out.size; i++){
+          if(!tree.decode(reader, totalBits, out.data[i])) return false;
+        }
+        used = (reader.position() + 7) / 8;
+      }else{
+        for(size_t done=0; done<out.size; ){
+          size_t count = std::min<uint64_t>(out.size - done, code->run());
+          size_t runBytes;
+          if(!code->decode(payload.data + used, payload.size - used, (char*)out.data + done, count, runBytes)) return false;
+          used += runBytes;
+          done += count;
+        }
+      }
+      if(stats){
+        stats->rawBytes += out.size;
+        stats->archiveBytes += Adaptive::FRAME_HEADER_SIZE + payload.size;
+        stats->symbols += out.size;
+        stats->codedBits += payload.size * 8;
+        stats->blocks++;
+      }
+      //no bytes beyond the padding
+      return used == payload.size;
+    }
+    //decompresses a whole stream from in, every frame is written and flushed once it is decoded
+    //prefix holds bytes already taken from in, at most HEADER_SIZE
+    bool decompress(std::istream& in, std::ostream& out, const std::string& prefix = ""){
+      unsigned char header[Adaptive::HEADER_SIZE];
+      size_t have = std::min(prefix.length(), size_t(Adaptive::HEADER_SIZE));
+      memcpy(header, prefix.data(), have);
+      if(!this->read(in, header + have, Adaptive::HEADER_SIZE - have) || !this->open(header, Adaptive::HEADER_SIZE)) return false;
+      std::vector<unsigned char> payload;
+      std::vector<unsigned char> raw;
+      while(true){
+        unsigned char frameHeader[Adaptive::FRAME_HEADER_SIZE];
+        uint32_t rawSize, payloadSize;
+        if(!this->read(in, frameHeader, Adaptive::FRAME_HEADER_SIZE) || !this->frameSizes(frameHeader, rawSize, payloadSize)) return false;
+        if(rawSize == 0) break;
+        payload.resize(payloadSize);
+        raw.resize(rawSize);
+        if(!this->read(in, payload.data(), payloadSize)) return false;
+        if(!this->decodeFrame(Span<const unsigned char>(payload.data(), payloadSize), Span<unsigned char>(raw.data(), rawSize))) return false;
+        Stats::Timer timer(stats, Stats::WRITE);
+        out.write((const char*)raw.data(), rawSize);
+        out.flush();
+        if(!out) return false;
+      }
+      if(stats) stats->archiveBytes += Adaptive::FRAME_HEADER_SIZE;
+      return true;
+    }
+};
+
+#endif